@@ -0,0 +1,231 @@
+/* read buffer placement benchmark
+ * Copyright 2026 the libebb contributors
+ *
+ * This software may be distributed under the "MIT" license included in the
+ * README
+ *
+ * Many connections each get an EBB_READ_BUFFER sized buffer, from
+ * malloc, from an ebb_slab on normal pages and from an ebb_slab on
+ * hugepages. Then requests "arrive" on random connections: a request is
+ * copied into the connection's buffer, as recv() would, and parsed
+ * there. With enough connections the buffers span far more 4 KB pages
+ * than the TLB covers. dTLB load misses are counted with
+ * perf_event_open(2) where the kernel allows it; the amount of memory
+ * on transparent hugepages is taken from /proc/self/smaps_rollup.
+ *
+ * The plain slab's pages are marked MADV_NOHUGEPAGE, so that with THP
+ * set to "always" it is still a 4 KB page baseline. A warning is printed
+ * if a run meant to be on 4 KB pages has hugepages all the same.
+ *
+ *   ./bench_buffers [connections] [seconds per run]
+ */
+#include "ebb.h"
+#include <stdlib.h>
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#ifdef __linux__
+# include <sys/ioctl.h>
+# include <sys/syscall.h>
+# include <linux/perf_event.h>
+#endif
+
+#define REQUEST "GET /products/search?q=mechanical+keyboard&sort=price HTTP/1.1\r\n" \
+                "Host: www.example.com\r\n" \
+                "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101 Firefox/115.0\r\n" \
+                "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n" \
+                "Accept-Language: en-US,en;q=0.5\r\n" \
+                "Accept-Encoding: gzip, deflate, br\r\n" \
+                "Cookie: session=8f3a9c2b41d7; _ga=GA1.2.1234567890.1234567890\r\n" \
+                "Connection: keep-alive\r\n" \
+                "\r\n"
+
+static ebb_request request;
+static int completed;
+
+static void on_complete(ebb_request *r)
+{
+  completed++;
+}
+
+static ebb_request* new_request(void *data)
+{
+  ebb_request_init(&request);
+  request.on_complete = on_complete;
+  return &request;
+}
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Returns a counter of dTLB load misses of this thread, or -1. */
+static int tlb_counter(void)
+{
+#ifdef __linux__
+  struct perf_event_attr attr;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HW_CACHE;
+  attr.config = PERF_COUNT_HW_CACHE_DTLB
+              | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+              | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+  return -1;
+#endif
+}
+
+/* Megabytes of this process on transparent hugepages, or -1. */
+static int thp_megabytes(void)
+{
+  FILE *f = fopen("/proc/self/smaps_rollup", "r");
+  char line[256];
+  int kb = -1;
+
+  if(f == NULL) return -1;
+  while(fgets(line, sizeof(line), f))
+    if(1 == sscanf(line, "AnonHugePages: %d kB", &kb))
+      break;
+  fclose(f);
+  return kb < 0 ? -1 : kb / 1024;
+}
+
+/* Returns the megabytes on transparent hugepages after the run. */
+static int run(const char *name, char **buffers, int n, double seconds)
+{
+  ebb_request_parser parser;
+  long reads = 0;
+  long long misses = -1;
+  double start, elapsed;
+  int fd = tlb_counter();
+  int thp;
+
+  srand(1);
+  completed = 0;
+#ifdef __linux__
+  if(fd >= 0) {
+    ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+  }
+#endif
+  start = now();
+  do {
+    int i;
+    /* check the clock every 1024 reads */
+    for(i = 0; i < 1024; i++) {
+      char *buffer = buffers[rand() % n];
+      memcpy(buffer, REQUEST, sizeof(REQUEST) - 1);
+      ebb_request_parser_init(&parser);
+      parser.new_request = new_request;
+      ebb_request_parser_execute(&parser, buffer, sizeof(REQUEST) - 1, 0);
+    }
+    reads += 1024;
+    elapsed = now() - start;
+  } while(elapsed < seconds);
+#ifdef __linux__
+  if(fd >= 0) {
+    ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    if(sizeof(misses) != read(fd, &misses, sizeof(misses)))
+      misses = -1;
+    close(fd);
+  }
+#endif
+
+  if(completed != reads) {
+    fprintf(stderr, "%s: %d requests completed, expected %ld\n", name, completed, reads);
+    exit(1);
+  }
+
+  printf("%-16s %10.1f", name, elapsed * 1e9 / reads);
+  if(misses >= 0)
+    printf(" %17.3f", (double)misses / reads);
+  else
+    printf(" %17s", "-");
+  thp = thp_megabytes();
+  printf(" %8d\n", thp);
+  return thp;
+}
+
+/* Keeps the kernel from putting the buffers on transparent hugepages.
+ * They lie in one or a few slab chunks, so the range from the lowest to
+ * the highest covers them; madvise skips the holes between chunks.
+ */
+static void no_hugepages(char **buffers, int n)
+{
+#ifdef MADV_NOHUGEPAGE
+  long page = sysconf(_SC_PAGESIZE);
+  uintptr_t lo = (uintptr_t)buffers[0], hi = lo;
+  int i;
+
+  for(i = 1; i < n; i++) {
+    if((uintptr_t)buffers[i] < lo) lo = (uintptr_t)buffers[i];
+    if((uintptr_t)buffers[i] > hi) hi = (uintptr_t)buffers[i];
+  }
+  lo -= lo % page;
+  hi += EBB_READ_BUFFER;
+  madvise((void*)lo, hi - lo, MADV_NOHUGEPAGE);
+#endif
+}
+
+/* Allocates a buffer for each connection from the allocator, or with
+ * malloc if it is NULL, and runs the benchmark on them. Unless huge is
+ * set the slab's buffers are kept on 4 KB pages.
+ */
+static void bench(const char *name, ebb_allocator *allocator, int huge, char **buffers, int n, double seconds)
+{
+  int i;
+
+  for(i = 0; i < n; i++) {
+    buffers[i] = allocator ? allocator->alloc(allocator, EBB_READ_BUFFER) : malloc(EBB_READ_BUFFER);
+    assert(buffers[i]);
+  }
+  if(allocator && !huge)
+    no_hugepages(buffers, n);
+  /* touch them, as a first read would */
+  for(i = 0; i < n; i++)
+    memset(buffers[i], 0, EBB_READ_BUFFER);
+
+  if(0 < run(name, buffers, n, seconds) && !huge)
+    fprintf(stderr, "warning: transparent hugepages during the %s run, it is not a 4 KB page baseline\n", name);
+  for(i = 0; i < n; i++) {
+    if(allocator)
+      allocator->free(allocator, buffers[i], EBB_READ_BUFFER);
+    else
+      free(buffers[i]);
+  }
+}
+
+int main(int argc, char **argv)
+{
+  int n = argc > 1 ? atoi(argv[1]) : 20000;
+  double seconds = argc > 2 ? atof(argv[2]) : 2.0;
+  char **buffers = malloc(n * sizeof(char*));
+  ebb_slab slab;
+
+  assert(buffers);
+  printf("%d connections, %d MB of read buffers\n", n, (int)((double)n * EBB_READ_BUFFER / (1024 * 1024)));
+  printf("%-16s %10s %17s %8s\n", "buffers", "ns/read", "dTLB-misses/read", "THP MB");
+
+  bench("malloc", NULL, 0, buffers, n, seconds);
+
+  if(0 > ebb_slab_init(&slab, (size_t)n * EBB_READ_BUFFER, 0)) return 1;
+  bench("slab", &slab.allocator, 0, buffers, n, seconds);
+  ebb_slab_destroy(&slab);
+
+  if(0 > ebb_slab_init(&slab, (size_t)n * EBB_READ_BUFFER, 1)) return 1;
+  bench(slab.huge_chunks ? "slab hugetlb" : "slab thp", &slab.allocator, 1, buffers, n, seconds);
+  ebb_slab_destroy(&slab);
+
+  return 0;
+}
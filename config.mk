@@ -7,7 +7,7 @@ EVLIBS = -L${EVLIB} -lev
 
 # includes and libs
 INCS = -I${EVINC}
-LIBS = ${EVLIBS} #-lefence
+LIBS = ${EVLIBS} -lpthread #-lefence
 
 # flags
 CPPFLAGS = -DVERSION=\"$(VERSION)\"
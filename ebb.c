@@ -22,11 +22,17 @@
  * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
  * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. 
  */
+#define _GNU_SOURCE /* accept4 */
 #include <assert.h>
 #include <string.h>
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>     /* writev */
+#ifdef __linux__
+# include <sys/sendfile.h>
+# include <sys/epoll.h>
+#endif
 #include <netinet/tcp.h> /* TCP_NODELAY */
 #include <netinet/in.h>  /* inet_ntoa */
 #include <arpa/inet.h>   /* inet_ntoa */
@@ -34,6 +40,8 @@
 #include <stdio.h>      /* perror */
 #include <errno.h>      /* perror */
 #include <stdlib.h> /* for the default methods */
+#include <stddef.h>     /* offsetof */
+#include <pthread.h>
 #include <ev.h>
 
 #include "ebb.h"
@@ -51,7 +59,23 @@
 
 #define error(FORMAT, ...) fprintf(stderr, "error: " FORMAT "\n", ##__VA_ARGS__)
 
-#define CONNECTION_HAS_SOMETHING_TO_WRITE (connection->to_write != NULL)
+#define CONNECTION_HAS_SOMETHING_TO_WRITE (connection->write_head != NULL)
+
+/* don't bother calling recv() with less space than this */
+#define MIN_RECV 1024
+
+/* most iovecs handed to a single sendmsg() */
+#define MAX_IOV 64
+
+/* Scoreboard figures have one writer, the server's thread, so a relaxed
+ * load and store do. Readers in other processes see them without
+ * anything like a lock.
+ */
+#define SCORE_ADD(server, field, n) do {                               \
+  ebb_score *score_ = (server)->score;                                 \
+  if(score_)                                                           \
+    __atomic_store_n(&score_->field, score_->field + (n), __ATOMIC_RELAXED); \
+} while(0)
 
 static void 
 set_nonblock (int fd)
@@ -61,15 +85,639 @@ set_nonblock (int fd)
   assert(0 <= r && "Setting socket non-block failed!");
 }
 
+/* more says that further data follows right away, the kernel may then
+ * hold back a partial segment */
 static ssize_t 
-nosigpipe_push(void *data, const void *buf, size_t len)
+nosigpipe_pushv(int fd, struct iovec *iov, int iovcnt, int more)
 {
-  int fd = (int)(long)data;
-  int flags = 0;
 #ifdef MSG_NOSIGNAL
-  flags = MSG_NOSIGNAL;
+  struct msghdr msg;
+  int flags = MSG_NOSIGNAL;
+#ifdef MSG_MORE
+  if(more) flags |= MSG_MORE;
+#endif
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = iovcnt;
+  return sendmsg(fd, &msg, flags);
+#else
+  /* SO_NOSIGPIPE is set on the socket */
+  return writev(fd, iov, iovcnt);
+#endif
+}
+
+static ssize_t
+push_file(int fd, int file_fd, off_t offset, size_t len)
+{
+#ifdef __linux__
+  return sendfile(fd, file_fd, &offset, len);
+#else
+  /* no portable sendfile(), copy through user space */
+  char buf[16*1024];
+  ssize_t r = pread(file_fd, buf, MIN(len, sizeof(buf)), offset);
+  if(r <= 0) return r;
+  return send(fd, buf, r, 0);
 #endif
-  return send(fd, buf, len, flags);
+}
+
+/* Read buffers come from the server's allocator. Those of the default
+ * size are recycled through a free list on the server, linked through
+ * their first bytes.
+ */
+static char*
+get_buffer(ebb_server *server)
+{
+  char *buffer = server->free_buffers;
+
+  if(buffer == NULL)
+    return ebb_server_alloc(server, EBB_READ_BUFFER);
+
+  server->free_buffers = *(char**)buffer;
+  server->free_buffer_count--;
+  return buffer;
+}
+
+static void
+put_buffer(ebb_server *server, char *buffer, size_t size)
+{
+  if(size != EBB_READ_BUFFER || server->free_buffer_count >= server->max_free_buffers) {
+    ebb_server_free(server, buffer, size);
+    return;
+  }
+  *(char**)buffer = server->free_buffers;
+  server->free_buffers = buffer;
+  server->free_buffer_count++;
+}
+
+static void
+release_read_buffer(ebb_connection *connection)
+{
+  if(connection->read_buffer == NULL) return;
+  put_buffer(connection->server, connection->read_buffer, connection->read_buffer_size);
+  connection->read_buffer = NULL;
+  connection->read_buffer_size = 0;
+  connection->buffered_data = 0;
+}
+
+/* Request arenas. Chunks of EBB_ARENA_CHUNK bytes, and allocations too
+ * large for them, come from the server's allocator and are linked
+ * through a header. All go back once the connection has answered
+ * everything it was asked, so idle connections hold none.
+ */
+struct arena_chunk {
+  struct arena_chunk *next;
+  size_t size;
+};
+
+#define ARENA_ALIGN(n) (((n) + 15) & ~(size_t)15)
+
+/* Links a new chunk with room for size bytes into the arena. */
+static char*
+arena_chunk(ebb_connection *connection, size_t size)
+{
+  struct arena_chunk *chunk;
+
+  size += sizeof(struct arena_chunk);
+  chunk = ebb_server_alloc(connection->server, size);
+  if(chunk == NULL) return NULL;
+  chunk->size = size;
+  chunk->next = connection->arena.chunks;
+  connection->arena.chunks = chunk;
+  return (char*)(chunk + 1);
+}
+
+static void
+reset_arena(ebb_connection *connection)
+{
+  struct arena_chunk *chunk = connection->arena.chunks;
+
+  while(chunk) {
+    struct arena_chunk *next = chunk->next;
+    ebb_server_free(connection->server, chunk, chunk->size);
+    chunk = next;
+  }
+  connection->arena.chunks = NULL;
+  connection->arena.pos = connection->arena.end = NULL;
+}
+
+/* Resets the arena if no request is being parsed, all responses are
+ * out and no offloaded work can still be looking at it.
+ */
+static void
+maybe_reset_arena(ebb_connection *connection)
+{
+  if(connection->arena.chunks == NULL) return;
+  if(connection->parser.current_request != NULL
+  || CONNECTION_HAS_SOMETHING_TO_WRITE
+  || connection->offloads > 0) return;
+  reset_arena(connection);
+}
+
+/* Removes the first entry of the write queue. Its release callback is
+ * made, and its after_write_cb if it was sent completely.
+ */
+static void
+shift_write(ebb_connection *connection)
+{
+  ebb_write *w = connection->write_head;
+
+  connection->write_head = w->next;
+  if(connection->write_head == NULL)
+    connection->write_tail = NULL;
+
+  if(w->release)
+    w->release(connection, w->release_data);
+  if(w->written == w->len && w->after_write_cb)
+    w->after_write_cb(connection);
+  if(w->allocator)
+    w->allocator->free(w->allocator, w, w->alloc_size);
+  else
+    free(w);
+}
+
+/* Removes the entries at the front of the write queue which have been
+ * sent completely, making their callbacks.
+ */
+static void
+finish_writes(ebb_connection *connection)
+{
+  while(CONNECTION_HAS_SOMETHING_TO_WRITE &&
+        connection->write_head->written == connection->write_head->len)
+    shift_write(connection);
+  maybe_reset_arena(connection);
+}
+
+/* Work on the write queue that is put off until the end of the loop
+ * iteration, done by server->deferred_watcher: callbacks for writes that
+ * completed inside ebb_connection_write(), so that a callback which
+ * writes again doesn't recurse, and with server->coalesce_writes the
+ * sending itself.
+ */
+static void
+defer_writes(ebb_connection *connection)
+{
+  ebb_server *server = connection->server;
+
+  if(connection->write_deferred) return;
+  connection->write_deferred = TRUE;
+  connection->next_deferred = server->deferred_head;
+  server->deferred_head = connection;
+  ev_prepare_start(server->loop, &server->deferred_watcher);
+}
+
+static void
+undefer_writes(ebb_connection *connection)
+{
+  ebb_connection **p = &connection->server->deferred_head;
+
+  if(!connection->write_deferred) return;
+  while(*p != connection)
+    p = &(*p)->next_deferred;
+  *p = connection->next_deferred;
+  connection->write_deferred = FALSE;
+}
+
+static ebb_write*
+first_unsent(ebb_connection *connection)
+{
+  ebb_write *w = connection->write_head;
+  while(w && w->written == w->len)
+    w = w->next;
+  return w;
+}
+
+/* Marks n bytes of the write queue, starting at w, as sent. */
+static void
+consume_writes(ebb_write *w, size_t n)
+{
+  for(; w && n > 0; w = w->next) {
+    if(w->file_fd >= 0) {
+      size_t l = MIN(n, w->len - w->written);
+      w->file_offset += l;
+      w->written += l;
+      n -= l;
+      continue;
+    }
+    while(n > 0 && w->iovcnt > 0) {
+      size_t l = MIN(n, w->iov->iov_len);
+      w->iov->iov_base = (char*)w->iov->iov_base + l;
+      w->iov->iov_len -= l;
+      w->written += l;
+      n -= l;
+      if(w->iov->iov_len == 0) {
+        w->iov++;
+        w->iovcnt--;
+      }
+    }
+  }
+  assert(n == 0);
+}
+
+/* Sends as much of the write queue as the socket takes. Entries are
+ * left in the queue, see finish_writes(). Returns 1 if everything was
+ * sent, 0 if the socket is full and -1 on error.
+ */
+static int
+flush_writes(ebb_connection *connection)
+{
+  struct iovec iov[MAX_IOV];
+  int i, iovcnt;
+  size_t want;
+  ebb_write *w, *first;
+  ssize_t sent;
+
+  while((first = first_unsent(connection)) != NULL) {
+    w = first;
+    sent = 0;
+
+    if(w->file_fd >= 0) {
+      want = w->len - w->written;
+      sent = push_file(connection->fd, w->file_fd, w->file_offset, want);
+      /* 0 means the file is shorter than promised */
+      if(sent == 0) return -1;
+    } else {
+      /* as many queued writes as fit go out with one syscall */
+      iovcnt = 0;
+      want = 0;
+      for(; w && w->file_fd < 0 && iovcnt < MAX_IOV; w = w->next) {
+        for(i = 0; i < w->iovcnt && iovcnt < MAX_IOV; i++) {
+          iov[iovcnt++] = w->iov[i];
+          want += w->iov[i].iov_len;
+        }
+      }
+      /* a file follows? don't send the headers in a packet of their own */
+      sent = nosigpipe_pushv(connection->fd, iov, iovcnt, w != NULL);
+      if(sent == 0) return 0;
+    }
+
+    if(sent < 0) {
+      if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return 0;
+      return -1;
+    }
+
+    ebb_connection_reset_timeout(connection);
+    SCORE_ADD(connection->server, bytes_out, sent);
+    consume_writes(first, sent);
+    if((size_t)sent < want) return 0;
+  }
+  return 1;
+}
+
+/* Sends what the socket takes right away and starts the write watcher
+ * for the rest.
+ */
+static void
+start_writing(ebb_connection *connection)
+{
+  int r = flush_writes(connection);
+  if(r < 0) {
+    error("close connection on write.");
+    ebb_connection_abort(connection);
+    return;
+  }
+  if(r == 0)
+    ev_io_start(connection->server->loop, &connection->write_watcher);
+}
+
+static void
+queue_write(ebb_connection *connection, ebb_write *w, int coalesce)
+{
+  w->next = NULL;
+  if(connection->write_tail)
+    connection->write_tail->next = w;
+  else
+    connection->write_head = w;
+  connection->write_tail = w;
+
+  if(ev_is_active(&connection->write_watcher)) return;
+
+  /* collect everything written during this loop iteration and send it
+   * together */
+  if(coalesce) {
+    defer_writes(connection);
+    return;
+  }
+
+  /* Usually the socket takes a response right away. Try that before
+   * bothering the event loop; only wait for it if it doesn't.
+   */
+  start_writing(connection);
+  if(connection->write_head->written == connection->write_head->len)
+    defer_writes(connection);
+}
+
+static void close_connection(ebb_connection *connection);
+
+/* Internal callback 
+ * called by server->deferred_watcher
+ */
+static void
+on_deferred(struct ev_loop *loop, ev_prepare *watcher, int revents)
+{
+  ebb_server *server = watcher->data;
+  ebb_connection *connection;
+
+  do {
+    while((connection = server->deferred_head) != NULL) {
+      server->deferred_head = connection->next_deferred;
+      connection->write_deferred = FALSE;
+      if(!ev_is_active(&connection->write_watcher))
+        start_writing(connection);
+      finish_writes(connection);
+    }
+    /* after the writes, so that coalesced responses still go out */
+    while((connection = server->closing_head) != NULL) {
+      server->closing_head = connection->next_closing;
+      close_connection(connection);
+    }
+  } while(server->deferred_head != NULL);
+  ev_prepare_stop(loop, watcher);
+}
+
+/* Messages from other threads. Any thread may push onto a server's
+ * inbox; only the server's own thread takes messages out, all at once,
+ * so a plain lock-free stack does.
+ */
+static ebb_message*
+take_all(ebb_server *server)
+{
+  ebb_message *message, *next, *list = NULL;
+
+  message = __atomic_exchange_n(&server->inbox, NULL, __ATOMIC_ACQUIRE);
+  /* oldest first */
+  while(message) {
+    next = message->next;
+    message->next = list;
+    list = message;
+    message = next;
+  }
+  return list;
+}
+
+/* Internal callback
+ * called by server->async_watcher, woken from other threads
+ */
+static void
+on_async(struct ev_loop *loop, ev_async *watcher, int revents)
+{
+  ebb_server *server = watcher->data;
+  ebb_message *message, *next;
+
+  for(message = take_all(server); message; message = next) {
+    next = message->next;
+    message->cb(server, message);
+    __atomic_sub_fetch(&server->inbox_count, 1, __ATOMIC_RELAXED);
+  }
+
+  if(server->group && __atomic_load_n(&server->group->stopping, __ATOMIC_ACQUIRE))
+    ev_break(loop, EVBREAK_ALL);
+}
+
+/**
+ * Has message->cb called on the thread running server's loop, with the
+ * server and message as arguments. Safe to call from any thread. The
+ * loop only runs while something keeps it alive besides the inbox; see
+ * ebb_server_ref.
+ */
+void
+ebb_server_post(ebb_server *server, ebb_message *message)
+{
+  ebb_message *head = __atomic_load_n(&server->inbox, __ATOMIC_RELAXED);
+
+  __atomic_add_fetch(&server->inbox_count, 1, __ATOMIC_RELAXED);
+  do {
+    message->next = head;
+  } while(!__atomic_compare_exchange_n( &server->inbox
+                                      , &head
+                                      , message
+                                      , TRUE
+                                      , __ATOMIC_RELEASE
+                                      , __ATOMIC_RELAXED
+                                      ));
+  /* if the inbox was not empty the server has been woken already and
+   * has not looked yet */
+  if(head == NULL)
+    ev_async_send(server->loop, &server->async_watcher);
+}
+
+/**
+ * While referenced the server's loop does not return from ev_run for
+ * lack of watchers, so that messages posted to it are handled. Call on
+ * the server's thread, ebb_server_unref when done.
+ */
+void
+ebb_server_ref(ebb_server *server)
+{
+  if(server->inbox_refs++ == 0)
+    ev_ref(server->loop);
+}
+
+void
+ebb_server_unref(ebb_server *server)
+{
+  assert(server->inbox_refs > 0);
+  if(--server->inbox_refs == 0)
+    ev_unref(server->loop);
+}
+
+/**
+ * Allocates size bytes from server->allocator, or with malloc if there
+ * is none. For new_connection and new_request; call it on the server's
+ * thread. Returns NULL on failure.
+ */
+void*
+ebb_server_alloc(ebb_server *server, size_t size)
+{
+  if(server->allocator)
+    return server->allocator->alloc(server->allocator, size);
+  return malloc(size);
+}
+
+/**
+ * Frees memory from ebb_server_alloc. size must be what was asked for.
+ */
+void
+ebb_server_free(ebb_server *server, void *ptr, size_t size)
+{
+  if(server->allocator)
+    server->allocator->free(server->allocator, ptr, size);
+  else
+    free(ptr);
+}
+
+/* Connection handles. A handle names a connection to other threads
+ * without pointing at it: the low half is a slot in a registry, the high
+ * half the slot's generation, which changes when the connection closes.
+ * Slots come in chunks that never move, so any thread can look one up
+ * without a lock; taking and freeing slots, once per connection, locks.
+ *
+ * slot->server is the connection's server. While a connection migrates
+ * slot->next_server names the server it goes to; messages that reach
+ * the old server are sent on.
+ */
+#define HANDLE_CHUNK 1024
+#define HANDLE_CHUNKS 4096
+
+struct handle_slot {
+  ebb_connection *connection;
+  ebb_server *server;
+  ebb_server *next_server;
+  unsigned int generation;
+  unsigned int next_free;
+};
+
+static struct handle_slot *handle_chunks[HANDLE_CHUNKS];
+static unsigned int handle_slots = 0;
+static unsigned int handle_free = 0; /* index + 1 of the first free slot */
+static pthread_mutex_t handle_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define HANDLE_INDEX(handle) ((unsigned int)((handle) & 0xffffffff))
+#define HANDLE_GENERATION(handle) ((unsigned int)((handle) >> 32))
+
+static struct handle_slot*
+handle_slot(ebb_handle handle)
+{
+  unsigned int index = HANDLE_INDEX(handle);
+  struct handle_slot *chunk;
+
+  if(index / HANDLE_CHUNK >= HANDLE_CHUNKS) return NULL;
+  chunk = __atomic_load_n(&handle_chunks[index / HANDLE_CHUNK], __ATOMIC_ACQUIRE);
+  return chunk ? &chunk[index % HANDLE_CHUNK] : NULL;
+}
+
+static void
+free_handle(ebb_connection *connection)
+{
+  struct handle_slot *slot = handle_slot(connection->handle);
+  unsigned int index = HANDLE_INDEX(connection->handle);
+
+  pthread_mutex_lock(&handle_lock);
+  /* generation 0 is never used, handle 0 means none */
+  __atomic_store_n(&slot->generation,
+      slot->generation + 1 ? slot->generation + 1 : 1, __ATOMIC_RELEASE);
+  __atomic_store_n(&slot->server, NULL, __ATOMIC_RELEASE);
+  __atomic_store_n(&slot->next_server, NULL, __ATOMIC_RELEASE);
+  slot->connection = NULL;
+  slot->next_free = handle_free;
+  handle_free = index + 1;
+  pthread_mutex_unlock(&handle_lock);
+  connection->handle = 0;
+}
+
+/* Connection timeouts. Instead of an ev_timer per connection, which
+ * would be restarted on every read and write, I/O only updates
+ * connection->last_activity. Connections sit in a wheel of slots, one
+ * per EBB_TIMEOUT_TICK seconds, in the slot of the tick at which their
+ * timeout would run out if there was no further activity. A single
+ * timer on the server visits one slot per tick; connections that turn
+ * out to have been active since are moved further along.
+ */
+static void
+wheel(ebb_connection *connection, ev_tstamp now)
+{
+  ebb_server *server = connection->server;
+  ev_tstamp left = connection->last_activity + connection->timeout - now;
+  int ticks, slot;
+
+  ticks = left <= 0 ? 1 : (int)(left / EBB_TIMEOUT_TICK) + 1;
+  if(ticks > EBB_TIMEOUT_SLOTS) ticks = EBB_TIMEOUT_SLOTS;
+  slot = (server->wheel_pos + ticks - 1) % EBB_TIMEOUT_SLOTS;
+
+  connection->wheel_slot = slot;
+  connection->wheel_prev = NULL;
+  connection->wheel_next = server->wheel[slot];
+  if(connection->wheel_next)
+    connection->wheel_next->wheel_prev = connection;
+  server->wheel[slot] = connection;
+
+  if(server->wheel_count++ == 0)
+    ev_timer_again(server->loop, &server->wheel_watcher);
+}
+
+static void
+unwheel(ebb_connection *connection)
+{
+  ebb_server *server = connection->server;
+
+  if(connection->wheel_slot < 0) return;
+  if(connection->wheel_prev)
+    connection->wheel_prev->wheel_next = connection->wheel_next;
+  else
+    server->wheel[connection->wheel_slot] = connection->wheel_next;
+  if(connection->wheel_next)
+    connection->wheel_next->wheel_prev = connection->wheel_prev;
+  connection->wheel_slot = -1;
+
+  if(--server->wheel_count == 0)
+    ev_timer_stop(server->loop, &server->wheel_watcher);
+}
+
+/* Internal callback 
+ * called by server->wheel_watcher, every EBB_TIMEOUT_TICK seconds
+ */
+static void 
+on_tick(struct ev_loop *loop, ev_timer *watcher, int revents)
+{
+  ebb_server *server = watcher->data;
+  ebb_connection *connection, *next;
+  ev_tstamp now = ev_now(loop);
+  int slot = server->wheel_pos;
+
+  assert(watcher == &server->wheel_watcher);
+
+  next = server->wheel[slot];
+  server->wheel[slot] = NULL;
+  server->wheel_pos = (slot + 1) % EBB_TIMEOUT_SLOTS;
+
+  while((connection = next) != NULL) {
+    next = connection->wheel_next;
+    connection->wheel_slot = -1;
+    server->wheel_count--;
+
+    if(connection->last_activity + connection->timeout > now) {
+      wheel(connection, now);
+      continue;
+    }
+
+    //printf("on_timeout\n");
+
+    /* if on_timeout returns true, we don't time out */
+    if(connection->on_timeout) {
+      int r = connection->on_timeout(connection);
+
+      if(r == EBB_AGAIN) {
+        connection->last_activity = now;
+        wheel(connection, now);
+        continue;
+      }
+    }
+
+    SCORE_ADD(server, timeouts, 1);
+    ebb_connection_abort(connection);
+  }
+
+  if(server->wheel_count == 0)
+    ev_timer_stop(loop, watcher);
+}
+
+/* The end of a closed connection once no offloaded work can look at it
+ * anymore: the arena goes, then on_close. Also called from ebb_pool.c.
+ */
+void
+ebb_connection_finish_close(ebb_connection *connection)
+{
+  reset_arena(connection);
+  if(connection->on_close)
+    connection->on_close(connection);
+}
+
+/* For ebb_pool.c: offloaded work is back, which may have been all that
+ * kept the arena.
+ */
+void
+ebb_connection_maybe_reset_arena(ebb_connection *connection)
+{
+  maybe_reset_arena(connection);
 }
 
 static void 
@@ -77,43 +725,86 @@ close_connection(ebb_connection *connection)
 {
   ev_io_stop(connection->server->loop, &connection->read_watcher);
   ev_io_stop(connection->server->loop, &connection->write_watcher);
-  ev_timer_stop(connection->server->loop, &connection->timeout_watcher);
+  unwheel(connection);
+
+  if(connection->abortive) {
+    /* reset the connection instead of going through TIME_WAIT */
+    struct linger ling = {1, 0};
+    setsockopt(connection->fd, SOL_SOCKET, SO_LINGER, (void *)&ling, sizeof(ling));
+  }
 
   if(0 > close(connection->fd))
     error("problem closing connection fd");
 
   connection->open = FALSE;
+  __atomic_sub_fetch(&connection->server->connection_count, 1, __ATOMIC_RELAXED);
+  SCORE_ADD(connection->server, connections, -1);
+  if(connection->handle)
+    free_handle(connection);
+  if(connection->reused_request) {
+    ebb_server_free(connection->server, connection->reused_request, sizeof(ebb_request));
+    connection->reused_request = NULL;
+  }
 
-  if(connection->on_close)
-    connection->on_close(connection);
+  undefer_writes(connection);
+  release_read_buffer(connection);
+  /* give back what could not be sent */
+  while(CONNECTION_HAS_SOMETHING_TO_WRITE)
+    shift_write(connection);
+
+  /* with offloaded work still running on_close waits for it, see
+   * ebb_connection_offload */
+  if(connection->offloads == 0)
+    ebb_connection_finish_close(connection);
   /* No access to the connection past this point! 
    * The user is allowed to free in the callback
    */
 }
 
-/* Internal callback 
- * called by connection->timeout_watcher
+/* Makes room in connection->read_buffer for the next recv(). Bytes the
+ * parser is done with are dropped and the rest is moved to the front. If
+ * that is not enough the buffer doubles, up to server->max_read_buffer.
+ * Returns FALSE if the current request does not fit.
  */
-static void 
-on_timeout(struct ev_loop *loop, ev_timer *watcher, int revents)
+static int
+make_room(ebb_connection *connection)
 {
-  ebb_connection *connection = watcher->data;
-
-  assert(watcher == &connection->timeout_watcher);
-
-  //printf("on_timeout\n");
-
-  /* if on_timeout returns true, we don't time out */
-  if(connection->on_timeout) {
-    int r = connection->on_timeout(connection);
-
-    if(r == EBB_AGAIN) {
-      ebb_connection_reset_timeout(connection);
-      return;
-    }
+  size_t size = connection->read_buffer_size;
+  size_t max = connection->server->max_read_buffer;
+  char *buffer;
+
+  if(connection->read_buffer == NULL) {
+    connection->read_buffer = get_buffer(connection->server);
+    if(connection->read_buffer == NULL) return FALSE;
+    connection->read_buffer_size = EBB_READ_BUFFER;
+    connection->buffered_data = 0;
+    return TRUE;
   }
 
-  ebb_connection_schedule_close(connection);
+  if(size - connection->buffered_data >= MIN_RECV) return TRUE;
+
+  connection->buffered_data = ebb_request_parser_relocate( &connection->parser
+                                                         , connection->read_buffer
+                                                         , connection->buffered_data
+                                                         , connection->read_buffer
+                                                         );
+  if(size - connection->buffered_data >= MIN_RECV) return TRUE;
+
+  /* can't grow? whatever space is left will have to do */
+  if(size >= max) return connection->buffered_data < size;
+  size = MIN(2 * size, max);
+  buffer = ebb_server_alloc(connection->server, size);
+  if(buffer == NULL) return connection->buffered_data < connection->read_buffer_size;
+
+  connection->buffered_data = ebb_request_parser_relocate( &connection->parser
+                                                         , connection->read_buffer
+                                                         , connection->buffered_data
+                                                         , buffer
+                                                         );
+  put_buffer(connection->server, connection->read_buffer, connection->read_buffer_size);
+  connection->read_buffer = buffer;
+  connection->read_buffer_size = size;
+  return TRUE;
 }
 
 /* Internal callback 
@@ -123,42 +814,59 @@ static void
 on_readable(struct ev_loop *loop, ev_io *watcher, int revents)
 {
   ebb_connection *connection = watcher->data;
-  size_t offset = connection->buffered_data;
-  int left = EBB_READ_BUFFER - offset;
-  char* recv_buffer = connection->read_buffer + offset;
+  size_t offset;
   ssize_t recved;
 
   //printf("on_readable\n");
-  // TODO -- why is this broken?
-  //assert(ev_is_active(&connection->timeout_watcher));
   assert(watcher == &connection->read_watcher);
 
-  // No more buffer space.
-  if(left == 0) goto error;
-
   if(EV_ERROR & revents) {
     error("on_readable() got error event, closing connection.");
     goto error;
   }
 
-  recved = recv(connection->fd, recv_buffer, left, 0);
-  if(recved <= 0) goto error;
+  // No more buffer space.
+  if(!make_room(connection)) goto error;
+  offset = connection->buffered_data;
+
+  recved = recv( connection->fd
+               , connection->read_buffer + offset
+               , connection->read_buffer_size - offset
+               , 0
+               );
+  if(recved == 0) {
+    /* the peer is done */
+    ebb_connection_schedule_close(connection);
+    return;
+  }
+  if(recved < 0) {
+    if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return;
+    goto error;
+  }
   connection->buffered_data += recved;
+  SCORE_ADD(connection->server, bytes_in, recved);
 
   ebb_connection_reset_timeout(connection);
 
   ebb_request_parser_execute(&connection->parser, connection->read_buffer,
                                 recved, offset);
 
-  if(ebb_request_parser_is_finished(&connection->parser)) {
-    connection->buffered_data = 0;
+  /* Between requests nothing in the buffer is needed anymore. Hand it
+   * back so that idle connections don't hold on to memory.
+   */
+  if(connection->parser.current_request == NULL) {
+    release_read_buffer(connection);
+    maybe_reset_arena(connection);
   }
 
   /* parse error? just drop the client. screw the 400 response */
-  if(ebb_request_parser_has_error(&connection->parser)) goto error;
+  if(ebb_request_parser_has_error(&connection->parser)) {
+    SCORE_ADD(connection->server, parse_errors, 1);
+    ebb_connection_schedule_close(connection);
+  }
   return;
 error:
-  ebb_connection_schedule_close(connection);
+  ebb_connection_abort(connection);
 }
 
 /* Internal callback 
@@ -168,63 +876,84 @@ static void
 on_writable(struct ev_loop *loop, ev_io *watcher, int revents)
 {
   ebb_connection *connection = watcher->data;
-  ssize_t sent;
+  int r;
   
   //printf("on_writable\n");
 
-  assert(CONNECTION_HAS_SOMETHING_TO_WRITE);
-  assert(connection->written <= connection->to_write_len);
-  // TODO -- why is this broken?
-  //assert(ev_is_active(&connection->timeout_watcher));
   assert(watcher == &connection->write_watcher);
 
-  if(connection->to_write == 0)
-    goto stop_writing;
-
-    sent = nosigpipe_push( (void*)(long)connection->fd
-                         , connection->to_write + connection->written
-                         , connection->to_write_len - connection->written
-                         );
-    if(sent < 0) goto error;
-    if(sent == 0) return;
+  /* drain the queue in order until the socket is full. callbacks may
+   * queue more. */
+  do {
+    r = flush_writes(connection);
+    finish_writes(connection);
+    if(r < 0) goto error;
+    if(r == 0) return;
+  } while(CONNECTION_HAS_SOMETHING_TO_WRITE);
 
-  ebb_connection_reset_timeout(connection);
-
-  connection->written += sent;
-
-  if(connection->written == connection->to_write_len) {
-    goto stop_writing;
-  }
-  return;
-stop_writing:
   ev_io_stop(loop, watcher);
-  connection->to_write = NULL;
-
-  if(connection->after_write_cb)
-    connection->after_write_cb(connection);
   return;
 error:
   error("close connection on write.");
-  ebb_connection_schedule_close(connection);
-}
-
-static void 
-on_goodbye(struct ev_loop *loop, ev_timer *watcher, int revents)
-{
-  ebb_connection *connection = watcher->data;
-  assert(watcher == &connection->goodbye_watcher);
-
-  close_connection(connection);
+  ev_io_stop(loop, watcher);
+  ebb_connection_abort(connection);
 }
 
-
 static ebb_request* 
 new_request_wrapper(void *data)
 {
   ebb_connection *connection = data;
+  ebb_request *request = NULL;
+
+  __atomic_add_fetch(&connection->server->requests, 1, __ATOMIC_RELAXED);
+  SCORE_ADD(connection->server, requests, 1);
   if(connection->new_request)
-    return connection->new_request(connection);
-  return NULL;
+    request = connection->new_request(connection);
+  if(request)
+    request->connection = connection;
+  return request;
+}
+
+/* Accepts one connection from the listen queue. Returns FALSE if there
+ * was none or accept() failed.
+ */
+static int
+accept_connection(ebb_server *server)
+{
+  struct sockaddr_in addr; // connector's address information
+  socklen_t addr_len = sizeof(addr); 
+  int fd;
+
+#ifdef SOCK_NONBLOCK
+  fd = accept4( server->fd
+              , (struct sockaddr*) & addr
+              , & addr_len
+              , SOCK_NONBLOCK | SOCK_CLOEXEC
+              );
+#else
+  fd = accept( server->fd
+             , (struct sockaddr*) & addr
+             , & addr_len
+             );
+#endif
+  if(fd < 0) {
+    if(errno != EAGAIN && errno != EWOULDBLOCK) {
+      __atomic_add_fetch(&server->accept_errors, 1, __ATOMIC_RELAXED);
+      perror("accept()");
+    }
+    return FALSE;
+  }
+  __atomic_add_fetch(&server->accepted, 1, __ATOMIC_RELAXED);
+
+#ifndef SOCK_NONBLOCK
+  set_nonblock(fd);
+#endif
+
+  if(server->on_accept)
+    server->on_accept(server, fd, &addr);
+  else
+    ebb_server_adopt(server, fd, &addr);
+  return TRUE;
 }
 
 /* Internal callback 
@@ -234,6 +963,7 @@ static void
 on_connection(struct ev_loop *loop, ev_io *watcher, int revents)
 {
   ebb_server *server = watcher->data;
+  int i;
 
   //printf("on connection!\n");
 
@@ -246,33 +976,48 @@ on_connection(struct ev_loop *loop, ev_io *watcher, int revents)
     ebb_server_unlisten(server);
     return;
   }
-  
-  struct sockaddr_in addr; // connector's address information
-  socklen_t addr_len = sizeof(addr); 
-  int fd = accept( server->fd
-                 , (struct sockaddr*) & addr
-                 , & addr_len
-                 );
-  if(fd < 0) {
-    if(errno != EAGAIN && errno != EWOULDBLOCK) {
-        perror("accept()");
-    }
-    return;
+
+#ifdef EPOLLEXCLUSIVE
+  if(server->accept_epoll_fd >= 0) {
+    struct epoll_event event;
+    epoll_wait(server->accept_epoll_fd, &event, 1, 0);
   }
+#endif
+
+  /* take what is waiting, up to accept_budget connections. the rest
+   * waits for the next loop iteration so existing connections are served
+   * in between. */
+  for(i = 0; i < server->accept_budget; i++) {
+    if(!accept_connection(server)) return;
+  }
+  server->accept_budget_exhausted++;
+}
 
+/**
+ * Serves a connection accepted elsewhere, as if the server had accepted
+ * it itself: asks server->new_connection for an ebb_connection and
+ * starts reading. fd must be non-blocking. Call this on the thread
+ * running the server's loop. Returns 0, or -1 if new_connection
+ * refused, in which case fd is closed.
+ */
+int 
+ebb_server_adopt(ebb_server *server, int fd, struct sockaddr_in *addr)
+{
   ebb_connection *connection = NULL;
+
   if(server->new_connection)
-    connection = server->new_connection(server, &addr);
+    connection = server->new_connection(server, addr);
   if(connection == NULL) {
     close(fd);
-    return;
+    return -1;
   } 
+  __atomic_add_fetch(&server->connection_count, 1, __ATOMIC_RELAXED);
+  SCORE_ADD(server, connections, 1);
   
-  set_nonblock(fd);
   connection->fd = fd;
   connection->open = TRUE;
   connection->server = server;
-  memcpy(&connection->sockaddr, &addr, addr_len);
+  memcpy(&connection->sockaddr, addr, sizeof(struct sockaddr_in));
   if(server->port[0] != '\0')
     connection->ip = inet_ntoa(connection->sockaddr.sin_addr);  
 
@@ -286,9 +1031,97 @@ on_connection(struct ev_loop *loop, ev_io *watcher, int revents)
   ev_io_set(&connection->read_watcher, connection->fd, EV_READ);
   /* XXX: seperate error watcher? */
 
-  ev_timer_again(loop, &connection->timeout_watcher);
+  connection->last_activity = ev_now(server->loop);
+  wheel(connection, connection->last_activity);
+
+  ev_io_start(server->loop, &connection->read_watcher);
+  return 0;
+}
+
+/* Between requests, with nothing to send and no memory borrowed from
+ * the server's allocator: read buffer or arena.
+ */
+static int
+connection_is_idle(ebb_connection *connection)
+{
+  return connection->open
+      && !connection->closing
+      && connection->parser.current_request == NULL
+      && connection->read_buffer == NULL
+      && !CONNECTION_HAS_SOMETHING_TO_WRITE
+      && !connection->write_deferred
+      && connection->offloads == 0
+      && connection->arena.chunks == NULL;
+}
+
+/**
+ * Fills list with up to max of the server's connections which
+ * ebb_connection_detach would take, those furthest from timing out
+ * first. Returns how many it found.
+ */
+int 
+ebb_server_idle_connections(ebb_server *server, ebb_connection **list, int max)
+{
+  ebb_connection *connection;
+  int i, n = 0;
+
+  for(i = 1; i <= EBB_TIMEOUT_SLOTS && n < max; i++) {
+    int slot = (server->wheel_pos + EBB_TIMEOUT_SLOTS - i) % EBB_TIMEOUT_SLOTS;
+    for(connection = server->wheel[slot]; connection && n < max; connection = connection->wheel_next) {
+      if(connection_is_idle(connection))
+        list[n++] = connection;
+    }
+  }
+  return n;
+}
+
+/**
+ * Takes an idle connection off its server's loop. Idle means between
+ * requests with nothing left to write. Returns -1 if it is not idle.
+ * Until ebb_connection_attach nothing watches the connection; to is the
+ * server it will be attached to, where writes through the connection's
+ * handle are sent meanwhile. Call this on the connection's own thread.
+ *
+ * Also returns -1 if to has another allocator. The connection, its
+ * reused request and whatever the user allocated for it would later be
+ * freed into to's allocator, and an ebb_slab must not be shared between
+ * loops.
+ */
+int 
+ebb_connection_detach(ebb_connection *connection, ebb_server *to)
+{
+  ebb_server *server = connection->server;
+
+  if(!connection_is_idle(connection)) return -1;
+  if(to->allocator != server->allocator) return -1;
+  if(connection->handle)
+    __atomic_store_n(&handle_slot(connection->handle)->next_server, to, __ATOMIC_RELEASE);
+  ev_io_stop(server->loop, &connection->read_watcher);
+  ev_io_stop(server->loop, &connection->write_watcher);
+  unwheel(connection);
+  __atomic_sub_fetch(&server->connection_count, 1, __ATOMIC_RELAXED);
+  SCORE_ADD(server, connections, -1);
+  return 0;
+}
 
-  ev_io_start(loop, &connection->read_watcher);
+/**
+ * Continues a detached connection on server, which must be called on
+ * the thread running server's loop. The connection's callbacks run
+ * there from now on.
+ */
+void 
+ebb_connection_attach(ebb_connection *connection, ebb_server *server)
+{
+  connection->server = server;
+  __atomic_add_fetch(&server->connection_count, 1, __ATOMIC_RELAXED);
+  SCORE_ADD(server, connections, 1);
+  if(connection->handle) {
+    struct handle_slot *slot = handle_slot(connection->handle);
+    __atomic_store_n(&slot->server, server, __ATOMIC_RELEASE);
+    __atomic_store_n(&slot->next_server, NULL, __ATOMIC_RELEASE);
+  }
+  wheel(connection, ev_now(server->loop));
+  ev_io_start(server->loop, &connection->read_watcher);
 }
 
 /**
@@ -310,7 +1143,27 @@ ebb_server_listen_on_fd(ebb_server *server, const int fd)
   server->fd = fd;
   server->listening = TRUE;
   
-  ev_io_set (&server->connection_watcher, server->fd, EV_READ);
+#ifdef EPOLLEXCLUSIVE
+  /* libev can't ask for EPOLLEXCLUSIVE, so the socket goes into an epoll
+   * set of its own, with the flag, and the loop watches that. The kernel
+   * then wakes only one of the processes waiting for a connection. */
+  if(server->exclusive_accept) {
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN | EPOLLEXCLUSIVE;
+    server->accept_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if(server->accept_epoll_fd >= 0 &&
+       0 > epoll_ctl(server->accept_epoll_fd, EPOLL_CTL_ADD, fd, &event)) {
+      perror("epoll_ctl()");
+      close(server->accept_epoll_fd);
+      server->accept_epoll_fd = -1;
+    }
+  }
+#endif
+  ev_io_set ( &server->connection_watcher
+            , server->accept_epoll_fd >= 0 ? server->accept_epoll_fd : server->fd
+            , EV_READ
+            );
   ev_io_start (server->loop, &server->connection_watcher);
   
   return server->fd;
@@ -318,11 +1171,13 @@ ebb_server_listen_on_fd(ebb_server *server, const int fd)
 
 
 /**
- * Begin the server listening on a file descriptor This DOES NOT start the
- * event loop. Start the event loop after making this call.
+ * Opens a TCP socket bound to port on all interfaces, with the options
+ * ebb servers use, but does not listen on it yet. With reuse_port set
+ * other sockets may bind the same port (SO_REUSEPORT). Returns the file
+ * descriptor or -1.
  */
 int 
-ebb_server_listen_on_port(ebb_server *server, const int port)
+ebb_bind(const int port, int reuse_port)
 {
   int fd = -1;
   struct linger ling = {0, 0};
@@ -338,6 +1193,10 @@ ebb_server_listen_on_port(ebb_server *server, const int port)
   setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (void *)&flags, sizeof(flags));
   setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, (void *)&flags, sizeof(flags));
   setsockopt(fd, SOL_SOCKET, SO_LINGER, (void *)&ling, sizeof(ling));
+#ifdef SO_REUSEPORT
+  if(reuse_port)
+    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (void *)&flags, sizeof(flags));
+#endif
 
   /* XXX: Sending single byte chunks in a response body? Perhaps there is a
    * need to enable the Nagel algorithm dynamically. For now disabling.
@@ -357,22 +1216,64 @@ ebb_server_listen_on_port(ebb_server *server, const int port)
     perror("bind()");
     goto error;
   }
-  
-  int ret = ebb_server_listen_on_fd(server, fd);
-  if (ret >= 0) {
-      socklen_t len = sizeof(addr);
-      if (getsockname(fd, (struct sockaddr *)&addr, &len) == -1) {
-          perror("getsockname");
-          goto error;
-      }
-      sprintf(server->port, "%d", ntohs(addr.sin_port));
-  }
-  return ret;
+  return fd;
 error:
   if(fd > 0) close(fd);
   return -1;
 }
 
+/**
+ * Begin the server listening on a file descriptor This DOES NOT start the
+ * event loop. Start the event loop after making this call.
+ */
+int 
+ebb_server_listen_on_port(ebb_server *server, const int port)
+{
+  struct sockaddr_in addr;
+  socklen_t len = sizeof(addr);
+  int fd = ebb_bind(port, server->reuse_port);
+
+  if(fd < 0)
+    return -1;
+  if(0 > ebb_server_listen_on_fd(server, fd)) {
+    close(fd);
+    return -1;
+  }
+  if (getsockname(fd, (struct sockaddr *)&addr, &len) == -1) {
+    perror("getsockname");
+    ebb_server_unlisten(server);
+    return -1;
+  }
+  sprintf(server->port, "%d", ntohs(addr.sin_port));
+  return fd;
+}
+
+/**
+ * Looks at the server's listen queue: how many connections wait to be
+ * accepted and how many fit. When the queue is full the kernel drops new
+ * connections; it doesn't count this per socket, but a queue that stays
+ * near full (together with server->accept_budget_exhausted going up)
+ * means the server can't keep up. Returns -1 where the platform does not
+ * tell (only Linux does).
+ */
+int 
+ebb_server_accept_queue(ebb_server *server, unsigned int *waiting, unsigned int *size)
+{
+#if defined(__linux__) && defined(TCP_INFO)
+  struct tcp_info info;
+  socklen_t len = sizeof(info);
+
+  if(0 > getsockopt(server->fd, IPPROTO_TCP, TCP_INFO, &info, &len))
+    return -1;
+  /* for listening sockets these two hold the queue length and limit */
+  *waiting = info.tcpi_unacked;
+  *size = info.tcpi_sacked;
+  return 0;
+#else
+  return -1;
+#endif
+}
+
 /**
  * Stops the server. Will not accept new connections.  Does not drop
  * existing connections.
@@ -382,12 +1283,63 @@ ebb_server_unlisten(ebb_server *server)
 {
   if(server->listening) {
     ev_io_stop(server->loop, &server->connection_watcher);
+    if(server->accept_epoll_fd >= 0) {
+      close(server->accept_epoll_fd);
+      server->accept_epoll_fd = -1;
+    }
     close(server->fd);
     server->port[0] = '\0';
     server->listening = FALSE;
   }
 }
 
+/* Internal callback
+ * called by server->score_watcher every EBB_SCORE_INTERVAL seconds.
+ * How late it runs is the loop's lag: time spent in callbacks, or
+ * blocked, when the timer was due.
+ */
+static void
+on_score_tick(struct ev_loop *loop, ev_timer *watcher, int revents)
+{
+  ebb_server *server = watcher->data;
+  ev_tstamp lag = ev_time() - server->score_due;
+
+  if(lag < 0.) lag = 0.;
+  __atomic_store_n(&server->score->loop_lag, (uint64_t)(lag * 1e6), __ATOMIC_RELAXED);
+  /* what libev does for repeating timers */
+  server->score_due += EBB_SCORE_INTERVAL;
+  if(server->score_due < ev_now(loop))
+    server->score_due = ev_now(loop);
+}
+
+/**
+ * Has the server publish its figures in score, a slot of an
+ * ebb_scoreboard, from now on. The slot is cleared first. NULL stops
+ * publishing. Call on the server's thread or before its loop runs.
+ */
+void 
+ebb_server_set_score(ebb_server *server, ebb_score *score)
+{
+  if(server->score) {
+    ev_ref(server->loop);
+    ev_timer_stop(server->loop, &server->score_watcher);
+    __atomic_store_n(&server->score->in_use, 0, __ATOMIC_RELEASE);
+  }
+  server->score = score;
+  if(score == NULL) return;
+
+  memset(score, 0, sizeof(ebb_score));
+  score->pid = getpid();
+  score->connections = server->connection_count;
+  __atomic_store_n(&score->in_use, 1, __ATOMIC_RELEASE);
+
+  /* measuring lag shouldn't keep the loop running */
+  server->score_due = ev_now(server->loop) + EBB_SCORE_INTERVAL;
+  ev_timer_set(&server->score_watcher, EBB_SCORE_INTERVAL, EBB_SCORE_INTERVAL);
+  ev_timer_start(server->loop, &server->score_watcher);
+  ev_unref(server->loop);
+}
+
 /**
  * Initialize an ebb_server structure.  After calling ebb_server_init set
  * the callback server->new_connection and, optionally, callback data
@@ -409,6 +1361,47 @@ ebb_server_init(ebb_server *server, struct ev_loop *loop)
   server->secure = FALSE;
 
   server->new_connection = NULL;
+  server->max_read_buffer = EBB_MAX_READ_BUFFER;
+  server->free_buffers = NULL;
+  server->deferred_head = NULL;
+  server->closing_head = NULL;
+  ev_prepare_init(&server->deferred_watcher, on_deferred);
+  server->deferred_watcher.data = server;
+  server->free_buffer_count = 0;
+  server->max_free_buffers = EBB_MAX_FREE_BUFFERS;
+  server->coalesce_writes = FALSE;
+  server->accept_budget = EBB_ACCEPT_BUDGET;
+  server->accepted = 0;
+  server->accept_errors = 0;
+  server->accept_budget_exhausted = 0;
+  server->requests = 0;
+  server->connection_count = 0;
+  server->group = NULL;
+  server->reuse_port = FALSE;
+  server->on_accept = NULL;
+  server->inbox = NULL;
+  server->inbox_count = 0;
+  server->inbox_refs = 0;
+  /* the inbox alone does not keep the loop running */
+  ev_async_init(&server->async_watcher, on_async);
+  server->async_watcher.data = server;
+  ev_async_start(loop, &server->async_watcher);
+  ev_unref(loop);
+  server->load = 0;
+  server->balance_requests = 0;
+  server->migrated = 0;
+  server->pool = NULL;
+  server->allocator = NULL;
+  server->exclusive_accept = FALSE;
+  server->score = NULL;
+  ev_init(&server->score_watcher, on_score_tick);
+  server->score_watcher.data = server;
+  server->accept_epoll_fd = -1;
+  memset(server->wheel, 0, sizeof(server->wheel));
+  server->wheel_pos = 0;
+  server->wheel_count = 0;
+  ev_timer_init(&server->wheel_watcher, on_tick, 0., EBB_TIMEOUT_TICK);
+  server->wheel_watcher.data = server;
   server->data = NULL;
 }
 
@@ -436,6 +1429,8 @@ ebb_connection_init(ebb_connection *connection)
   connection->server = NULL;
   connection->ip = NULL;
   connection->open = FALSE;
+  connection->read_buffer = NULL;
+  connection->read_buffer_size = 0;
   connection->buffered_data = 0;
 
   ebb_request_parser_init( &connection->parser );
@@ -444,16 +1439,27 @@ ebb_connection_init(ebb_connection *connection)
   
   ev_init (&connection->write_watcher, on_writable);
   connection->write_watcher.data = connection;
-  connection->to_write = NULL;
+  connection->write_head = NULL;
+  connection->write_tail = NULL;
+  connection->write_deferred = FALSE;
+  connection->next_deferred = NULL;
 
   ev_init(&connection->read_watcher, on_readable);
   connection->read_watcher.data = connection;
 
-  ev_timer_init(&connection->goodbye_watcher, on_goodbye, 0., 0.);
-  connection->goodbye_watcher.data = connection;  
+  connection->closing = FALSE;
+  connection->abortive = FALSE;
+  connection->next_closing = NULL;
+  connection->offloads = 0;
+  connection->handle = 0;
+  connection->reused_request = NULL;
+  connection->arena.pos = connection->arena.end = NULL;
+  connection->arena.chunks = NULL;
 
-  ev_timer_init(&connection->timeout_watcher, on_timeout, 0., EBB_DEFAULT_TIMEOUT);
-  connection->timeout_watcher.data = connection;  
+  connection->timeout = EBB_DEFAULT_TIMEOUT;
+  connection->last_activity = 0.;
+  connection->wheel_slot = -1;
+  connection->wheel_prev = connection->wheel_next = NULL;
 
   connection->new_request = NULL;
   connection->on_timeout = NULL;
@@ -461,10 +1467,33 @@ ebb_connection_init(ebb_connection *connection)
   connection->data = NULL;
 }
 
+/**
+ * Closes the connection at the end of the current loop iteration, after
+ * queued writes got their chance. on_close is called then.
+ */
 void 
 ebb_connection_schedule_close (ebb_connection *connection)
 {
- ev_timer_start(connection->server->loop, &connection->goodbye_watcher);
+  ebb_server *server = connection->server;
+
+  if(connection->closing) return;
+  connection->closing = TRUE;
+  connection->next_closing = server->closing_head;
+  server->closing_head = connection;
+  ev_prepare_start(server->loop, &server->deferred_watcher);
+}
+
+/**
+ * Like ebb_connection_schedule_close, but what has not been sent is
+ * dropped and the peer gets a reset (SO_LINGER with a zero timeout).
+ * This keeps TIME_WAIT sockets from piling up; libebb does it for
+ * connections that time out or fail.
+ */
+void 
+ebb_connection_abort (ebb_connection *connection)
+{
+  connection->abortive = TRUE;
+  ebb_connection_schedule_close(connection);
 }
 
 /* 
@@ -473,28 +1502,380 @@ ebb_connection_schedule_close (ebb_connection *connection)
 void 
 ebb_connection_reset_timeout(ebb_connection *connection)
 {
-  ev_timer_again(connection->server->loop, &connection->timeout_watcher);
+  connection->last_activity = ev_now(connection->server->loop);
 }
 
 /**
- * Writes a string to the socket. This is actually sets a watcher
- * which may take multiple iterations to write the entire string.
+ * For new_request: returns the connection's own request object, freshly
+ * initialized with ebb_request_init, instead of allocating one per
+ * request. Requests on a connection are parsed one after the other, so
+ * one object serves them all; don't touch it after its on_complete, nor
+ * free it. It is freed when the connection closes. Returns NULL if it
+ * could not be allocated.
+ */
+ebb_request*
+ebb_connection_reuse_request(ebb_connection *connection)
+{
+  if(connection->reused_request == NULL) {
+    connection->reused_request = ebb_server_alloc(connection->server, sizeof(ebb_request));
+    if(connection->reused_request == NULL) return NULL;
+  }
+  ebb_request_init(connection->reused_request);
+  return connection->reused_request;
+}
+
+/**
+ * Allocates size bytes of scratch memory for a request: copies of
+ * header values, decoded parameters, response headers. It is never
+ * freed on its own; all of it goes at once when the connection has
+ * written every response and started no new request, which also
+ * covers memory handed to ebb_connection_writev or offloaded work.
+ * With pipelined requests that may be after several of them. Don't
+ * keep it longer. Small allocations are a pointer bump.
  *
- * This can only be called once at a time. If you call it again
- * while the connection is writing another buffer the ebb_connection_write
- * will return FALSE and ignore the request.
+ * Only for requests from a connection (request->connection set).
+ * Returns NULL on failure.
+ */
+void*
+ebb_request_alloc(ebb_request *request, size_t size)
+{
+  ebb_connection *connection = request->connection;
+  ebb_arena *arena;
+  char *p;
+
+  if(connection == NULL) return NULL;
+  arena = &connection->arena;
+  size = ARENA_ALIGN(size);
+
+  if(size > EBB_ARENA_CHUNK / 4)
+    return arena_chunk(connection, size);
+
+  if(arena->end - arena->pos < (ptrdiff_t)size) {
+    p = arena_chunk(connection, EBB_ARENA_CHUNK - sizeof(struct arena_chunk));
+    if(p == NULL) return NULL;
+    arena->pos = p;
+    arena->end = p + EBB_ARENA_CHUNK - sizeof(struct arena_chunk);
+  }
+  p = arena->pos;
+  arena->pos += size;
+  return p;
+}
+
+/**
+ * Copies len bytes of s, a header value for example, into the request's
+ * arena and terminates them with a NUL.
+ */
+char*
+ebb_request_strndup(ebb_request *request, const char *s, size_t len)
+{
+  char *copy = ebb_request_alloc(request, len + 1);
+
+  if(copy == NULL) return NULL;
+  memcpy(copy, s, len);
+  copy[len] = '\0';
+  return copy;
+}
+
+/**
+ * Writes a string to the socket. As much as the socket takes is sent
+ * right away, for the rest a watcher is set which may take multiple
+ * iterations to write the entire string. after_write_cb is called once
+ * it has been written, never from within ebb_connection_write.
+ *
+ * If the connection is already writing the string is queued behind what
+ * was written before. buf must stay valid until it has been written.
+ *
+ * Returns FALSE if the connection is no longer open or the queue entry
+ * could not be allocated. Nothing is queued then and no callback is
+ * made.
  */
 int 
 ebb_connection_write (ebb_connection *connection, const char *buf, size_t len, ebb_after_write_cb cb)
 {
-  if(ev_is_active(&connection->write_watcher))
+  return ebb_connection_queue_write(connection, buf, len, cb, NULL, NULL);
+}
+
+/**
+ * Like ebb_connection_write but additionally calls release (with
+ * release_data) once buf is no longer needed: after it was written, just
+ * before after_write_cb, or when the connection closes before that. Use
+ * it to free or unref buf. If FALSE is returned release is not called
+ * and buf is still the caller's.
+ */
+int 
+ebb_connection_queue_write ( ebb_connection *connection
+                           , const char *buf
+                           , size_t len
+                           , ebb_after_write_cb cb
+                           , ebb_connection_cb release
+                           , void *release_data
+                           )
+{
+  struct iovec iov;
+  iov.iov_base = (void*)buf;
+  iov.iov_len = len;
+  return ebb_connection_writev(connection, &iov, 1, cb, release, release_data);
+}
+
+/**
+ * Queues the buffers described by iov, for example a response's headers
+ * followed by its body, without copying them together. The iov array
+ * itself is copied, the buffers must stay valid until release is called.
+ * Consecutive queued writes are sent with as few syscalls as possible.
+ * Callbacks as for ebb_connection_queue_write.
+ */
+int 
+ebb_connection_writev ( ebb_connection *connection
+                      , const struct iovec *iov
+                      , int iovcnt
+                      , ebb_after_write_cb cb
+                      , ebb_connection_cb release
+                      , void *release_data
+                      )
+{
+  ebb_server *server = connection->server;
+  size_t size = sizeof(ebb_write) + iovcnt * sizeof(struct iovec);
+  ebb_write *w;
+  int i;
+
+  if(!connection->open) return FALSE;
+  w = ebb_server_alloc(server, size);
+  if(w == NULL) return FALSE;
+  w->allocator = server->allocator;
+  w->alloc_size = size;
+
+  w->iov = (struct iovec*)(w + 1);
+  w->iovcnt = iovcnt;
+  w->file_fd = -1;
+  w->file_offset = 0;
+  w->len = 0;
+  for(i = 0; i < iovcnt; i++) {
+    w->iov[i] = iov[i];
+    w->len += iov[i].iov_len;
+  }
+  w->written = 0;
+  w->after_write_cb = cb;
+  w->release = release;
+  w->release_data = release_data;
+  queue_write(connection, w, server->coalesce_writes);
+  return TRUE;
+}
+
+/**
+ * Queues len bytes of the file fd, starting at offset, to be sent with
+ * sendfile(2) where available. The file is sent in order with the other
+ * queued writes, so the response headers can be queued before it. fd is
+ * not closed by libebb, do that in release. The file offset of fd is not
+ * changed.
+ */
+int 
+ebb_connection_sendfile ( ebb_connection *connection
+                        , int fd
+                        , off_t offset
+                        , size_t len
+                        , ebb_after_write_cb cb
+                        , ebb_connection_cb release
+                        , void *release_data
+                        )
+{
+  ebb_server *server = connection->server;
+  ebb_write *w;
+
+  if(!connection->open) return FALSE;
+  w = ebb_server_alloc(server, sizeof(ebb_write));
+  if(w == NULL) return FALSE;
+  w->allocator = server->allocator;
+  w->alloc_size = sizeof(ebb_write);
+
+  w->iov = NULL;
+  w->iovcnt = 0;
+  w->file_fd = fd;
+  w->file_offset = offset;
+  w->len = len;
+  w->written = 0;
+  w->after_write_cb = cb;
+  w->release = release;
+  w->release_data = release_data;
+  queue_write(connection, w, server->coalesce_writes);
+  return TRUE;
+}
+
+static void
+release_buf(ebb_connection *connection, void *data)
+{
+  ebb_buf_unref(data);
+}
+
+/**
+ * Queues buf, holding a reference to it until it has been sent or the
+ * connection closes. The same buf can be queued on any number of
+ * connections; its bytes are never copied. Returns FALSE, without
+ * keeping a reference, if the write could not be queued.
+ */
+int
+ebb_connection_write_buf(ebb_connection *connection, ebb_buf *buf, ebb_after_write_cb cb)
+{
+  ebb_buf_ref(buf);
+  if(!ebb_connection_queue_write(connection, buf->base, buf->len, cb, release_buf, buf)) {
+    ebb_buf_unref(buf);
     return FALSE;
-  assert(!CONNECTION_HAS_SOMETHING_TO_WRITE);
-  connection->to_write = buf;
-  connection->to_write_len = len;
-  connection->written = 0;
-  connection->after_write_cb = cb;
-  ev_io_start(connection->server->loop, &connection->write_watcher);
+  }
   return TRUE;
 }
 
+/**
+ * A handle for the connection which other threads can pass to
+ * ebb_handle_write. It stays valid until the connection closes, after
+ * that writes through it are dropped. Call on the connection's thread.
+ * Returns 0 if no handle could be made.
+ */
+ebb_handle
+ebb_connection_handle(ebb_connection *connection)
+{
+  struct handle_slot *slot;
+  unsigned int index;
+
+  if(connection->handle || !connection->open)
+    return connection->handle;
+
+  pthread_mutex_lock(&handle_lock);
+  if(handle_free) {
+    index = handle_free - 1;
+    slot = handle_slot(index);
+    handle_free = slot->next_free;
+  } else {
+    index = handle_slots;
+    if(index % HANDLE_CHUNK == 0) {
+      struct handle_slot *chunk;
+      if(index / HANDLE_CHUNK >= HANDLE_CHUNKS ||
+         (chunk = calloc(HANDLE_CHUNK, sizeof(struct handle_slot))) == NULL) {
+        pthread_mutex_unlock(&handle_lock);
+        return 0;
+      }
+      __atomic_store_n(&handle_chunks[index / HANDLE_CHUNK], chunk, __ATOMIC_RELEASE);
+    }
+    handle_slots++;
+    slot = handle_slot(index);
+    __atomic_store_n(&slot->generation, 1, __ATOMIC_RELEASE);
+  }
+  slot->connection = connection;
+  __atomic_store_n(&slot->server, connection->server, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&handle_lock);
+
+  connection->handle = ((ebb_handle)slot->generation << 32) | index;
+  return connection->handle;
+}
+
+/* A write through a handle, on its way to the connection's thread. The
+ * ebb_write comes first so that the write queue can free it as usual.
+ */
+struct handle_write {
+  ebb_write write;
+  struct iovec iov;
+  ebb_message message;
+  ebb_handle handle;
+};
+
+/* Internal callback
+ * a write through a handle arrived
+ */
+static void
+on_handle_write(ebb_server *server, ebb_message *message)
+{
+  struct handle_write *hw = (struct handle_write*)
+    ((char*)message - offsetof(struct handle_write, message));
+  struct handle_slot *slot = handle_slot(hw->handle);
+  ebb_server *owner, *next;
+
+  if(slot == NULL) goto drop;
+
+  next = __atomic_load_n(&slot->next_server, __ATOMIC_ACQUIRE);
+  owner = __atomic_load_n(&slot->server, __ATOMIC_ACQUIRE);
+  if(owner == NULL) goto drop;
+  if(owner != server) {
+    /* it migrated before the write arrived */
+    ebb_server_post(owner, message);
+    return;
+  }
+  if(next != NULL && next != server) {
+    /* it is migrating; the write follows it */
+    ebb_server_post(next, message);
+    return;
+  }
+  /* this thread owns the connection, so the slot holds still */
+  if(slot->generation != HANDLE_GENERATION(hw->handle)) goto drop;
+
+  queue_write(slot->connection, &hw->write, TRUE);
+  return;
+drop:
+  if(hw->write.release)
+    hw->write.release(NULL, hw->write.release_data);
+  free(hw);
+}
+
+/**
+ * Writes buf to the connection behind handle, from any thread. The
+ * write is queued on the connection's thread; all writes that arrive
+ * in one go leave in as few syscalls as possible. buf must stay valid
+ * until release(connection, release_data) is called on the connection's
+ * thread. If the connection has closed in the meantime the write is
+ * dropped and release is called with a NULL connection.
+ *
+ * Returns 0 if the write is on its way, or -1 if the connection is
+ * known to be closed already, in which case release is not called.
+ */
+int
+ebb_handle_write ( ebb_handle handle
+                 , const char *buf
+                 , size_t len
+                 , ebb_connection_cb release
+                 , void *release_data
+                 )
+{
+  struct handle_slot *slot = handle_slot(handle);
+  struct handle_write *hw;
+  ebb_server *server;
+
+  if(slot == NULL) return -1;
+  if(__atomic_load_n(&slot->generation, __ATOMIC_ACQUIRE) != HANDLE_GENERATION(handle))
+    return -1;
+  server = __atomic_load_n(&slot->server, __ATOMIC_ACQUIRE);
+  if(server == NULL) return -1;
+
+  hw = malloc(sizeof(struct handle_write));
+  if(hw == NULL) return -1;
+  hw->iov.iov_base = (void*)buf;
+  hw->iov.iov_len = len;
+  hw->write.iov = &hw->iov;
+  hw->write.iovcnt = 1;
+  hw->write.file_fd = -1;
+  hw->write.file_offset = 0;
+  hw->write.len = len;
+  hw->write.written = 0;
+  hw->write.after_write_cb = NULL;
+  hw->write.release = release;
+  hw->write.release_data = release_data;
+  /* allocated on a foreign thread, so not from the server's allocator */
+  hw->write.allocator = NULL;
+  hw->message.cb = on_handle_write;
+  hw->handle = handle;
+  /* the slot may be reused by now; the connection's thread checks again */
+  ebb_server_post(server, &hw->message);
+  return 0;
+}
+
+/**
+ * ebb_handle_write for an ebb_buf, from any thread: a reference is held
+ * until the write has been sent or dropped. To push one event to many
+ * connections, make one ebb_buf and write it to each handle.
+ */
+int
+ebb_handle_write_buf(ebb_handle handle, ebb_buf *buf)
+{
+  ebb_buf_ref(buf);
+  if(0 > ebb_handle_write(handle, buf->base, buf->len, release_buf, buf)) {
+    ebb_buf_unref(buf);
+    return -1;
+  }
+  return 0;
+}
@@ -30,20 +30,45 @@ extern "C" {
 #endif
 
 #include <sys/socket.h>
+#include <sys/types.h>
+#include <stdint.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
+#include <pthread.h>
 #include <ev.h>
 #include "ebb_request_parser.h"
 
 #define EBB_MAX_CONNECTIONS 1024
+#define EBB_ACCEPT_BUDGET 64
 #define EBB_DEFAULT_TIMEOUT 30.0
+/* timeouts are checked every EBB_TIMEOUT_TICK seconds. the wheel covers
+ * EBB_TIMEOUT_SLOTS ticks, longer timeouts take extra turns. */
+#define EBB_TIMEOUT_TICK 1.0
+#define EBB_TIMEOUT_SLOTS 64
 
 #define EBB_AGAIN 0
 #define EBB_STOP 1
 
 typedef struct ebb_server     ebb_server;
 typedef struct ebb_connection ebb_connection;
+typedef struct ebb_write      ebb_write;
+typedef struct ebb_group      ebb_group;
+typedef struct ebb_group_stats ebb_group_stats;
+typedef struct ebb_message    ebb_message;
+typedef struct ebb_pool       ebb_pool;
+typedef struct ebb_pool_stats ebb_pool_stats;
+typedef struct ebb_prefork    ebb_prefork;
+typedef struct ebb_score      ebb_score;
+typedef struct ebb_scoreboard ebb_scoreboard;
+typedef struct ebb_prefork_worker ebb_prefork_worker;
+typedef struct ebb_allocator  ebb_allocator;
+typedef struct ebb_slab       ebb_slab;
+typedef struct ebb_arena      ebb_arena;
+typedef struct ebb_buf        ebb_buf;
 typedef void (*ebb_after_write_cb) (ebb_connection *connection); 
 typedef void (*ebb_connection_cb)(ebb_connection *connection, void *data);
+typedef void (*ebb_offload_fn)(void *arg);
+typedef uint64_t ebb_handle;
 
 struct ebb_server {
   int fd;                                       /* ro */
@@ -53,44 +78,142 @@ struct ebb_server {
   struct ev_loop *loop;                         /* ro */
   unsigned listening:1;                         /* ro */
   unsigned secure:1;                            /* ro */
+  unsigned long accepted;                       /* ro */
+  unsigned long accept_errors;                  /* ro */
+  unsigned long accept_budget_exhausted;        /* ro */
+  unsigned long requests;                       /* ro */
+  int connection_count;                         /* ro */
+  unsigned long load;                           /* ro */
+  unsigned long migrated;                       /* ro */
+  ebb_group *group;                             /* ro */
   ev_io connection_watcher;                     /* private */
+  int accept_epoll_fd;                          /* private */
+  ebb_score *score;                             /* ro */
+  ev_timer score_watcher;                       /* private */
+  ev_tstamp score_due;                          /* private */
+  ev_async async_watcher;                       /* private */
+  ebb_message *inbox;                           /* private */
+  int inbox_count;                              /* private */
+  int inbox_refs;                               /* private */
+  ev_timer balance_watcher;                     /* private */
+  unsigned long balance_requests;               /* private */
+  int (*on_accept) (ebb_server*, int, struct sockaddr_in*); /* private */
+  char *free_buffers;                           /* private */
+  ev_prepare deferred_watcher;                  /* private */
+  ebb_connection *deferred_head;                /* private */
+  ebb_connection *closing_head;                 /* private */
+  ev_timer wheel_watcher;                       /* private */
+  ebb_connection *wheel[EBB_TIMEOUT_SLOTS];     /* private */
+  int wheel_pos;                                /* private */
+  int wheel_count;                              /* private */
+  int free_buffer_count;                        /* ro */
 
   /* Public */
 
   /* Allocates and initializes an ebb_connection.  NULL by default. */
   ebb_connection* (*new_connection) (ebb_server*, struct sockaddr_in*);
 
+  /* A connection's read buffer starts at EBB_READ_BUFFER bytes and grows
+   * up to this size when a request's headers do not fit. Connections
+   * with larger requests are dropped. EBB_MAX_READ_BUFFER by default. */
+  size_t max_read_buffer;
+
+  /* Idle connections give their read buffer back to the server, which
+   * keeps up to this many for reuse. EBB_MAX_FREE_BUFFERS by default. */
+  int max_free_buffers;
+
+  /* If set, writes queued on a connection are not sent right away but
+   * collected until the end of the loop iteration and then sent with as
+   * few syscalls as possible. Saves syscalls with pipelined requests at
+   * the cost of a little latency. FALSE by default. */
+  int coalesce_writes;
+
+  /* Most connections accepted per readiness event of the listening
+   * socket. EBB_ACCEPT_BUDGET by default. */
+  int accept_budget;
+
+  /* Set SO_REUSEPORT on the socket ebb_server_listen_on_port creates, so
+   * several servers can listen on the same port. FALSE by default. */
+  int reuse_port;
+
+  /* When several processes listen on the same socket, wake only one of
+   * them per new connection (EPOLLEXCLUSIVE, Linux 4.5 and later).
+   * Set before ebb_server_listen_on_fd. FALSE by default. */
+  int exclusive_accept;
+
+  /* Runs work passed to ebb_connection_offload. May be shared by
+   * several servers. NULL by default. */
+  ebb_pool *pool;
+
+  /* Where the server allocates read buffers, write queue entries and
+   * offloaded tasks, and what ebb_server_alloc uses. An ebb_slab with
+   * hugepages puts the read buffers on 2 MB pages. Per loop; memory can
+   * be freed through another server's allocator after
+   * ebb_connection_migrate. NULL (malloc) by default. */
+  ebb_allocator *allocator;
+
   void *data;
 };
 
 #define EBB_READ_BUFFER 8192
+#define EBB_MAX_READ_BUFFER (64*1024)
+#define EBB_MAX_FREE_BUFFERS 128
+/* request arenas grow by chunks of this size. Allocations larger than a
+ * quarter of it get memory of their own. */
+#define EBB_ARENA_CHUNK 4096
+
+/* Scratch memory for the requests of a connection, see
+ * ebb_request_alloc.
+ */
+struct ebb_arena {
+  char *pos;                    /* private */
+  char *end;                    /* private */
+  void *chunks;                 /* private */
+};
 
+/* Fields are ordered by when they are used: what a read touches comes
+ * first, then the parser and what a write touches. The rest is rarely
+ * looked at.
+ */
 struct ebb_connection {
+  ev_io read_watcher;          /* private */
   int fd;                      /* ro */
-  struct sockaddr_in sockaddr; /* ro */
-  socklen_t socklen;           /* ro */ 
-  ebb_server *server;          /* ro */
-  char *ip;                    /* ro */
   unsigned open:1;             /* ro */
-
-  const char *to_write;              /* ro */
-  size_t to_write_len;               /* ro */
-  size_t written;                    /* ro */ 
-  ebb_after_write_cb after_write_cb; /* ro */
-
+  ebb_server *server;          /* ro */
+  char *read_buffer;           /* private */
+  size_t read_buffer_size;     /* private */
+  size_t buffered_data;        /* private */
+  ev_tstamp last_activity;     /* ro */
   ebb_request_parser parser;   /* private */
+
+  ebb_write *write_head;       /* private */
+  ebb_write *write_tail;       /* private */
   ev_io write_watcher;         /* private */
-  ev_io read_watcher;          /* private */
-  ev_timer timeout_watcher;    /* private */
-  ev_timer goodbye_watcher;    /* private */
+  unsigned write_deferred:1;      /* private */
+  ebb_connection *next_deferred;   /* private */
 
-  int buffered_data;                    /* private */
-  char read_buffer[EBB_READ_BUFFER];    /* private */
+  unsigned closing:1;          /* ro */
+  unsigned abortive:1;         /* private */
+  ebb_connection *next_closing; /* private */
+  int offloads;                /* ro */
+  ebb_handle handle;           /* private */
+  ebb_request *reused_request; /* private */
+  ebb_arena arena;             /* private */
+  ebb_connection *wheel_prev;  /* private */
+  ebb_connection *wheel_next;  /* private */
+  int wheel_slot;              /* private */
+  struct sockaddr_in sockaddr; /* ro */
+  socklen_t socklen;           /* ro */ 
+  char *ip;                    /* ro */
 
   /* Public */
 
   ebb_request* (*new_request) (ebb_connection*); 
 
+  /* Seconds of inactivity after which on_timeout is called, checked
+   * every EBB_TIMEOUT_TICK seconds. EBB_DEFAULT_TIMEOUT by default. */
+  ev_tstamp timeout;
+
   /* Returns EBB_STOP or EBB_AGAIN. NULL by default.  */
   int (*on_timeout) (ebb_connection*); 
 
@@ -99,15 +222,288 @@ struct ebb_connection {
   void *data;
 };
 
+/* An entry in a connection's write queue. */
+struct ebb_write {
+  struct iovec *iov;                 /* private */
+  int iovcnt;                        /* private */
+  int file_fd;                       /* private, -1 for memory */
+  off_t file_offset;                 /* private */
+  size_t len;                        /* ro */
+  size_t written;                    /* ro */
+  ebb_after_write_cb after_write_cb; /* ro */
+  ebb_connection_cb release;         /* ro */
+  void *release_data;                /* ro */
+  ebb_allocator *allocator;          /* private, NULL if malloc()ed */
+  size_t alloc_size;                 /* private */
+  ebb_write *next;                   /* private */
+};
+
+/* Memory for the library and, through ebb_server_alloc, for the user's
+ * new_connection and new_request. free gets the size that was asked
+ * for.
+ */
+struct ebb_allocator {
+  void* (*alloc) (ebb_allocator*, size_t size);
+  void (*free) (ebb_allocator*, void *ptr, size_t size);
+  void *data;
+};
+
+#define EBB_SLAB_CHUNK (2*1024*1024)
+#define EBB_SLAB_CLASSES 9      /* 32 bytes to 8 KB */
+
+/* An ebb_allocator cutting objects out of large chunks, with a free list
+ * for each power of two size. Memory goes back to the system only with
+ * ebb_slab_destroy; larger objects are malloc()ed. Not thread-safe.
+ */
+struct ebb_slab {
+  ebb_allocator allocator;                      /* ro */
+  void *free_lists[EBB_SLAB_CLASSES];           /* private */
+  char *chunk_pos;                              /* private */
+  char *chunk_end;                              /* private */
+  void *chunks;                                 /* private */
+  unsigned hugepages:1;                         /* private */
+  unsigned long chunk_count;                    /* ro */
+  unsigned long huge_chunks;                    /* ro, on explicit hugepages */
+  unsigned long in_use;                         /* ro */
+  unsigned long oversized;                      /* ro, malloc()ed, in use */
+};
+
+/* Immutable bytes with a reference count, which can be queued on many
+ * connections at once, on any server and thread, without copying; see
+ * ebb_connection_write_buf. Each queued write holds a reference until it
+ * has been sent.
+ */
+struct ebb_buf {
+  const char *base;                             /* ro */
+  size_t len;                                   /* ro */
+  int refs;                                     /* private */
+
+  /* Public */
+
+  /* Called when the last reference is dropped, on the thread that
+   * dropped it. ebb_buf_new sets it to free the buffer. */
+  void (*on_release) (ebb_buf*);
+
+  void *data;
+};
+
+/* Something for a server to do on its own thread, see ebb_server_post.
+ * Usually embedded at the start of a larger struct.
+ */
+struct ebb_message {
+  void (*cb) (ebb_server*, ebb_message*);     /* called on the server's thread */
+  ebb_message *next;                          /* private */
+};
+
+/* A group runs several servers listening on the same port, each with
+ * its own thread and ev_loop. The servers are complete ebb_servers;
+ * everything a server does happens on its own thread, so callbacks need
+ * no locking unless they share data between servers.
+ */
+struct ebb_group {
+  int nservers;                                 /* ro */
+  ebb_server *servers;                          /* ro */
+  pthread_t *threads;                           /* private */
+  int nthreads;                                 /* private */
+  int next_server;                              /* private */
+  unsigned running:1;                           /* ro */
+  int stopping;                                 /* private */
+  unsigned destroying:1;                        /* private */
+  ebb_server acceptor;                          /* ro */
+
+  /* Public */
+
+  /* If set, ebb_group_listen_on_port opens a single socket, accepted
+   * from by an extra thread which hands each connection to the server
+   * with the fewest. Balances better than SO_REUSEPORT when connection
+   * lifetimes vary a lot. FALSE by default. */
+  int use_acceptor;
+
+  /* If positive, every server compares the requests it handled in the
+   * last balance_interval seconds (server->load) with the others and
+   * moves idle connections to the least loaded one when it is well above
+   * the average. 0 (off) by default. */
+  ev_tstamp balance_interval;
+
+  /* Copied to every server by ebb_group_listen_on_port. Runs on the
+   * server's own thread. NULL by default. */
+  ebb_connection* (*new_connection) (ebb_server*, struct sockaddr_in*);
+
+  void *data;
+};
+
+#define EBB_MAX_OFFLOAD_QUEUE 1024
+
+/* Threads for blocking work which must not run on a loop, see
+ * ebb_connection_offload. Every thread has a queue, tasks go to them in
+ * turn and threads that run out take from the others.
+ */
+struct ebb_pool {
+  int nthreads;                                 /* ro */
+  pthread_t *threads;                           /* private */
+  struct ebb_pool_queue *queues;                /* private */
+  unsigned int next_queue;                      /* private */
+  int queued;                                   /* ro */
+  int running;                                  /* ro */
+  unsigned long rejected;                       /* ro */
+  pthread_mutex_t lock;                         /* private */
+  pthread_cond_t wakeup;                        /* private */
+  int sleeping;                                 /* private */
+  unsigned stopping:1;                          /* private */
+
+  /* Public */
+
+  /* ebb_connection_offload fails while this many tasks wait for a
+   * thread. EBB_MAX_OFFLOAD_QUEUE by default. */
+  int max_queued;
+};
+
+struct ebb_pool_stats {
+  int queued;               /* waiting for a thread */
+  int running;
+  unsigned long completed;
+  unsigned long rejected;   /* queue was full */
+  unsigned long stolen;     /* run by another thread than queued to */
+  double wait_average;      /* seconds from queueing to start */
+  double wait_max;
+};
+
+/* a worker that dies sooner than this after starting is restarted only
+ * this long after it started */
+#define EBB_PREFORK_MIN_UPTIME 1.0
+
+/* A supervisor process forking workers which share one listening
+ * socket, for isolation between them. Workers that die are restarted.
+ * It uses the default loop because of ev_child.
+ */
+struct ebb_prefork {
+  int fd;                                       /* ro */
+  char port[6];                                 /* ro */
+  int nworkers;                                 /* ro */
+  ebb_prefork_worker *workers;                  /* ro */
+  int index;                                    /* ro, in workers */
+  unsigned long restarts;                       /* ro */
+  unsigned stopping:1;                          /* private */
+
+  /* Public */
+
+  /* Runs a worker, in the forked process. The process exits when it
+   * returns. Watchers the supervisor had on the default loop are still
+   * active here, except for ebb_prefork's own; stop them first. */
+  void (*on_worker) (ebb_prefork*, int index);
+
+  void *data;
+};
+
+struct ebb_prefork_worker {
+  ebb_prefork *prefork;                         /* ro */
+  int index;                                    /* ro */
+  pid_t pid;                                    /* ro, 0 when not running */
+  ev_tstamp started;                            /* ro */
+  ev_child child_watcher;                       /* private */
+  ev_timer restart_watcher;                     /* private */
+};
+
+#define EBB_SCOREBOARD_MAGIC 0x65626273 /* "ebbs" */
+#define EBB_SCORE_INTERVAL 0.5
+
+/* A server's figures in a scoreboard, see ebb_server_set_score. One
+ * cache line, written only by the server's thread.
+ */
+struct ebb_score {
+  uint64_t connections;     /* open now */
+  uint64_t requests;
+  uint64_t bytes_in;
+  uint64_t bytes_out;
+  uint64_t parse_errors;
+  uint64_t timeouts;
+  uint64_t loop_lag;        /* microseconds, measured every EBB_SCORE_INTERVAL */
+  uint32_t pid;
+  uint32_t in_use;
+} __attribute__((aligned(64)));
+
+/* A file, usually in /dev/shm, mapped into every process of a server
+ * and into readers, which need no help from the server to look.
+ */
+struct ebb_scoreboard {
+  uint32_t magic;
+  uint32_t nslots;
+  uint32_t slot_size;
+  ebb_score slots[];
+} __attribute__((aligned(64)));
+
+/* Totals over the servers of a group. */
+struct ebb_group_stats {
+  int connections;
+  unsigned long accepted;
+  unsigned long accept_errors;
+  unsigned long requests;
+  unsigned long migrated;
+};
+
+int ebb_bind (const int port, int reuse_port);
+
 void ebb_server_init (ebb_server *server, struct ev_loop *loop);
+void ebb_server_set_score (ebb_server *server, ebb_score *score);
 int ebb_server_listen_on_port (ebb_server *server, const int port);
 int ebb_server_listen_on_fd (ebb_server *server, const int sfd);
 void ebb_server_unlisten (ebb_server *server);
+int ebb_server_accept_queue (ebb_server *server, unsigned int *waiting, unsigned int *size);
+int ebb_server_adopt (ebb_server *server, int fd, struct sockaddr_in *addr);
+int ebb_server_idle_connections (ebb_server *server, ebb_connection **list, int max);
+void ebb_server_post (ebb_server *server, ebb_message *message);
+void ebb_server_ref (ebb_server *server);
+void ebb_server_unref (ebb_server *server);
+void* ebb_server_alloc (ebb_server *server, size_t size);
+void ebb_server_free (ebb_server *server, void *ptr, size_t size);
+
+int ebb_slab_init (ebb_slab *slab, size_t reserve, int hugepages);
+void ebb_slab_destroy (ebb_slab *slab);
+
+int ebb_group_init (ebb_group *group, int nservers);
+int ebb_group_listen_on_port (ebb_group *group, const int port);
+int ebb_group_start (ebb_group *group);
+void ebb_group_stop (ebb_group *group);
+void ebb_group_destroy (ebb_group *group);
+void ebb_group_stats_get (ebb_group *group, ebb_group_stats *stats);
+int ebb_connection_migrate (ebb_connection *connection, ebb_server *server);
+
+void ebb_prefork_init (ebb_prefork *prefork);
+int ebb_prefork_listen_on_port (ebb_prefork *prefork, const int port);
+int ebb_prefork_start (ebb_prefork *prefork, int nworkers);
+void ebb_prefork_stop (ebb_prefork *prefork);
+
+ebb_scoreboard* ebb_scoreboard_create (const char *path, int nslots);
+ebb_scoreboard* ebb_scoreboard_open (const char *path);
+void ebb_scoreboard_close (ebb_scoreboard *board);
+
+ebb_buf* ebb_buf_new (const char *data, size_t len);
+void ebb_buf_init (ebb_buf *buf, const char *base, size_t len);
+ebb_buf* ebb_buf_ref (ebb_buf *buf);
+void ebb_buf_unref (ebb_buf *buf);
+
+int ebb_pool_init (ebb_pool *pool, int nthreads);
+void ebb_pool_destroy (ebb_pool *pool);
+void ebb_pool_stats_get (ebb_pool *pool, ebb_pool_stats *stats);
+int ebb_connection_offload (ebb_connection *connection, ebb_offload_fn fn, void *arg, ebb_connection_cb done);
 
 void ebb_connection_init (ebb_connection *);
 void ebb_connection_schedule_close (ebb_connection *);
+void ebb_connection_abort (ebb_connection *);
+int ebb_connection_detach (ebb_connection *, ebb_server *to);
+void ebb_connection_attach (ebb_connection *, ebb_server *);
 void ebb_connection_reset_timeout (ebb_connection *);
+ebb_request* ebb_connection_reuse_request (ebb_connection *);
+void* ebb_request_alloc (ebb_request *request, size_t size);
+char* ebb_request_strndup (ebb_request *request, const char *s, size_t len);
 int ebb_connection_write (ebb_connection *, const char *buf, size_t len, ebb_after_write_cb);
+int ebb_connection_queue_write (ebb_connection *, const char *buf, size_t len, ebb_after_write_cb, ebb_connection_cb release, void *release_data);
+int ebb_connection_writev (ebb_connection *, const struct iovec *iov, int iovcnt, ebb_after_write_cb, ebb_connection_cb release, void *release_data);
+int ebb_connection_sendfile (ebb_connection *, int fd, off_t offset, size_t len, ebb_after_write_cb, ebb_connection_cb release, void *release_data);
+int ebb_connection_write_buf (ebb_connection *, ebb_buf *buf, ebb_after_write_cb);
+ebb_handle ebb_connection_handle (ebb_connection *);
+int ebb_handle_write (ebb_handle handle, const char *buf, size_t len, ebb_connection_cb release, void *release_data);
+int ebb_handle_write_buf (ebb_handle handle, ebb_buf *buf);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,88 @@
+/* This file is part of libebb.
+ *
+ * Copyright (c) 2026 the libebb contributors
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <string.h>
+#include <stdlib.h>
+
+#include "ebb.h"
+
+static void
+free_buf(ebb_buf *buf)
+{
+  free(buf);
+}
+
+/**
+ * Makes a buffer holding a copy of len bytes of data, with one
+ * reference, which belongs to the caller. The copy lives in the same
+ * allocation as the ebb_buf and is freed with it. Returns NULL on
+ * failure.
+ */
+ebb_buf*
+ebb_buf_new(const char *data, size_t len)
+{
+  ebb_buf *buf = malloc(sizeof(ebb_buf) + len);
+
+  if(buf == NULL) return NULL;
+  memcpy(buf + 1, data, len);
+  ebb_buf_init(buf, (const char*)(buf + 1), len);
+  buf->on_release = free_buf;
+  return buf;
+}
+
+/**
+ * Initializes a buffer for len bytes at base which live elsewhere, a
+ * static string or a mapped file for example, with one reference. Set
+ * on_release to learn when they are not used anymore.
+ */
+void
+ebb_buf_init(ebb_buf *buf, const char *base, size_t len)
+{
+  buf->base = base;
+  buf->len = len;
+  buf->refs = 1;
+  buf->on_release = NULL;
+  buf->data = NULL;
+}
+
+/**
+ * Takes another reference. Any thread may take and drop references.
+ */
+ebb_buf*
+ebb_buf_ref(ebb_buf *buf)
+{
+  __atomic_add_fetch(&buf->refs, 1, __ATOMIC_RELAXED);
+  return buf;
+}
+
+/**
+ * Drops a reference. Dropping the last calls buf->on_release, on this
+ * thread.
+ */
+void
+ebb_buf_unref(ebb_buf *buf)
+{
+  if(__atomic_sub_fetch(&buf->refs, 1, __ATOMIC_ACQ_REL) == 0 && buf->on_release)
+    buf->on_release(buf);
+}
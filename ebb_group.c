@@ -0,0 +1,456 @@
+/* This file is part of libebb.
+ *
+ * Copyright (c) 2026 the libebb contributors
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdio.h>      /* perror */
+#include <stdlib.h>
+#include <pthread.h>
+#include <ev.h>
+
+#include "ebb.h"
+
+#ifndef TRUE
+# define TRUE 1
+#endif
+#ifndef FALSE
+# define FALSE 0
+#endif
+
+#define error(FORMAT, ...) fprintf(stderr, "error: " FORMAT "\n", ##__VA_ARGS__)
+
+/* a server balances when its load is this much above the average */
+#define EBB_BALANCE_THRESHOLD 1.25
+/* most connections a server gives away per balance_interval */
+#define EBB_MIGRATE_BATCH 16
+
+/* A connection on its way to another server of the group: either a
+ * freshly accepted fd or a migrating ebb_connection.
+ */
+struct handoff {
+  ebb_message message;
+  int fd;
+  struct sockaddr_in addr;
+  ebb_connection *connection;
+};
+
+/* Internal callback
+ * a handoff with a new fd arrived
+ */
+static void
+on_adopt(ebb_server *server, ebb_message *message)
+{
+  struct handoff *handoff = (struct handoff*)message;
+
+  /* servers being destroyed don't take new connections */
+  if(server->group->destroying)
+    close(handoff->fd);
+  else
+    ebb_server_adopt(server, handoff->fd, &handoff->addr);
+  free(handoff);
+}
+
+/* Internal callback
+ * a handoff with a migrating connection arrived
+ */
+static void
+on_migrate(ebb_server *server, ebb_message *message)
+{
+  struct handoff *handoff = (struct handoff*)message;
+
+  ebb_connection_attach(handoff->connection, server);
+  free(handoff);
+}
+
+static void*
+run_server(void *data)
+{
+  ebb_server *server = data;
+  ev_run(server->loop, 0);
+  return NULL;
+}
+
+/* The server with the fewest connections, counting those on their way
+ * to it. Ties go round robin. Runs on the acceptor thread.
+ */
+static ebb_server*
+least_loaded(ebb_group *group)
+{
+  ebb_server *best = NULL;
+  int i, load, best_load = 0;
+
+  for(i = 0; i < group->nservers; i++) {
+    ebb_server *server = &group->servers[(group->next_server + i) % group->nservers];
+    load = __atomic_load_n(&server->connection_count, __ATOMIC_RELAXED)
+         + __atomic_load_n(&server->inbox_count, __ATOMIC_RELAXED);
+    if(best == NULL || load < best_load) {
+      best = server;
+      best_load = load;
+    }
+  }
+  group->next_server = (group->next_server + 1) % group->nservers;
+  return best;
+}
+
+/* Internal callback
+ * server->on_accept of the acceptor
+ */
+static int
+hand_off(ebb_server *acceptor, int fd, struct sockaddr_in *addr)
+{
+  struct handoff *handoff = malloc(sizeof(struct handoff));
+
+  if(handoff == NULL) {
+    close(fd);
+    return -1;
+  }
+  handoff->message.cb = on_adopt;
+  handoff->fd = fd;
+  memcpy(&handoff->addr, addr, sizeof(struct sockaddr_in));
+  ebb_server_post(least_loaded(acceptor->group), &handoff->message);
+  return 0;
+}
+
+/**
+ * Moves an idle connection (see ebb_connection_detach) to another
+ * server of the same group. Call on the connection's thread; once this
+ * returns the connection belongs to the other thread. Returns -1 if the
+ * connection is not idle, the servers are not in one group or they
+ * allocate from different allocators.
+ */
+int
+ebb_connection_migrate(ebb_connection *connection, ebb_server *server)
+{
+  ebb_server *from = connection->server;
+  struct handoff *handoff;
+
+  if(server == from) return 0;
+  if(server->group == NULL || server->group != from->group) return -1;
+
+  handoff = malloc(sizeof(struct handoff));
+  if(handoff == NULL) return -1;
+  if(0 > ebb_connection_detach(connection, server)) {
+    free(handoff);
+    return -1;
+  }
+  __atomic_add_fetch(&from->migrated, 1, __ATOMIC_RELAXED);
+  handoff->message.cb = on_migrate;
+  handoff->connection = connection;
+  ebb_server_post(server, &handoff->message);
+  return 0;
+}
+
+/* Internal callback
+ * called by server->balance_watcher every group->balance_interval
+ */
+static void
+on_balance(struct ev_loop *loop, ev_timer *watcher, int revents)
+{
+  ebb_server *server = watcher->data;
+  ebb_group *group = server->group;
+  ebb_server *target = NULL;
+  ebb_connection *idle[EBB_MIGRATE_BATCH];
+  unsigned long load, total = 0, target_load = 0;
+  double average;
+  int i, n;
+
+  load = server->requests - server->balance_requests;
+  server->balance_requests = server->requests;
+  __atomic_store_n(&server->load, load, __ATOMIC_RELAXED);
+
+  /* the others' figures may be up to an interval old */
+  for(i = 0; i < group->nservers; i++) {
+    ebb_server *other = &group->servers[i];
+    unsigned long l = __atomic_load_n(&other->load, __ATOMIC_RELAXED);
+    total += l;
+    if(other != server && (target == NULL || l < target_load)) {
+      target = other;
+      target_load = l;
+    }
+  }
+  average = (double)total / group->nservers;
+  if(target == NULL || load == 0 || load <= average * EBB_BALANCE_THRESHOLD)
+    return;
+
+  /* assuming the connections carry the load evenly, moving this many
+   * brings the server to the average. only go half way so that servers
+   * deciding at the same time don't overshoot. */
+  n = (int)(server->connection_count * (load - average) / load / 2 + 0.5);
+  if(n > EBB_MIGRATE_BATCH) n = EBB_MIGRATE_BATCH;
+  if(n <= 0) return;
+
+  n = ebb_server_idle_connections(server, idle, n);
+  for(i = 0; i < n; i++)
+    ebb_connection_migrate(idle[i], target);
+}
+
+/* Makes server a member of group, running on a new loop. */
+static int
+init_server(ebb_group *group, ebb_server *server)
+{
+  struct ev_loop *loop = ev_loop_new(EVFLAG_AUTO);
+  if(loop == NULL)
+    return -1;
+  ebb_server_init(server, loop);
+  server->group = group;
+  /* the loop runs until ebb_group_stop, even with nothing to do */
+  ebb_server_ref(server);
+  ev_timer_init(&server->balance_watcher, on_balance, 0., 0.);
+  server->balance_watcher.data = server;
+  return 0;
+}
+
+static void
+destroy_server(ebb_server *server)
+{
+  ebb_server_unlisten(server);
+  /* hand out what is left in the inbox. migrating connections stay
+   * open like the rest */
+  ev_invoke(server->loop, &server->async_watcher, EV_ASYNC);
+  ev_timer_stop(server->loop, &server->balance_watcher);
+  ev_loop_destroy(server->loop);
+}
+
+/**
+ * Initialize an ebb_group of nservers servers, each with a new ev_loop.
+ * nservers <= 0 means one per online CPU. Set group->new_connection
+ * afterwards. Returns 0, or -1 if the loops could not be created.
+ */
+int
+ebb_group_init(ebb_group *group, int nservers)
+{
+  int i;
+
+  if(nservers <= 0)
+    nservers = sysconf(_SC_NPROCESSORS_ONLN);
+  if(nservers <= 0)
+    nservers = 1;
+
+  group->nservers = 0;
+  group->nthreads = 0;
+  group->next_server = 0;
+  group->running = FALSE;
+  group->stopping = FALSE;
+  group->destroying = FALSE;
+  group->use_acceptor = FALSE;
+  group->balance_interval = 0.;
+  group->new_connection = NULL;
+  group->data = NULL;
+  group->acceptor.loop = NULL;
+
+  group->servers = calloc(nservers, sizeof(ebb_server));
+  group->threads = calloc(nservers + 1, sizeof(pthread_t));
+  if(group->servers == NULL || group->threads == NULL)
+    goto error;
+
+  for(i = 0; i < nservers; i++) {
+    if(0 > init_server(group, &group->servers[i])) {
+      error("could not create an ev_loop for server %d", i);
+      goto error;
+    }
+    group->nservers++;
+  }
+  return 0;
+error:
+  ebb_group_destroy(group);
+  return -1;
+}
+
+/**
+ * Opens a listening socket on port for every server of the group, using
+ * SO_REUSEPORT so that the kernel spreads new connections over them.
+ * Where SO_REUSEPORT is missing the servers share one socket. With port
+ * 0 the first server picks a port and the others follow.
+ *
+ * With group->use_acceptor set only group->acceptor listens. Its loop
+ * is created here, groups without one don't pay for it.
+ */
+int
+ebb_group_listen_on_port(ebb_group *group, const int port)
+{
+  int i, p = port;
+
+  for(i = 0; i < group->nservers; i++) {
+    group->servers[i].new_connection = group->new_connection;
+    group->servers[i].data = group->data;
+  }
+
+  if(group->use_acceptor) {
+    if(group->acceptor.loop == NULL) {
+      if(0 > init_server(group, &group->acceptor)) {
+        error("could not create an ev_loop for the acceptor");
+        return -1;
+      }
+      group->acceptor.on_accept = hand_off;
+    }
+    if(0 > ebb_server_listen_on_port(&group->acceptor, port))
+      return -1;
+    /* connection->ip is only set by servers with a port */
+    for(i = 0; i < group->nservers; i++)
+      strcpy(group->servers[i].port, group->acceptor.port);
+    return group->acceptor.fd;
+  }
+
+  for(i = 0; i < group->nservers; i++) {
+    ebb_server *server = &group->servers[i];
+
+#ifdef SO_REUSEPORT
+    server->reuse_port = TRUE;
+    if(0 > ebb_server_listen_on_port(server, p))
+      goto error;
+    p = atoi(group->servers[0].port);
+#else
+    if(i == 0) {
+      if(0 > ebb_server_listen_on_port(server, p))
+        goto error;
+    } else {
+      int fd = dup(group->servers[0].fd);
+      if(fd < 0 || 0 > ebb_server_listen_on_fd(server, fd)) {
+        if(fd >= 0) close(fd);
+        goto error;
+      }
+      strcpy(server->port, group->servers[0].port);
+    }
+#endif
+  }
+  return group->servers[0].fd;
+error:
+  for(i = 0; i < group->nservers; i++)
+    ebb_server_unlisten(&group->servers[i]);
+  return -1;
+}
+
+/**
+ * Starts a thread for every server, and one for the acceptor if it
+ * listens, which runs its loop until ebb_group_stop is called. Returns 0
+ * or -1 if a thread could not be created, in which case the ones
+ * already running are stopped.
+ */
+int
+ebb_group_start(ebb_group *group)
+{
+  int i, nthreads = group->nservers;
+
+  assert(!group->running);
+  group->stopping = FALSE;
+
+  if(group->acceptor.loop && group->acceptor.listening)
+    nthreads++;
+
+  for(i = 0; i < group->nservers && group->balance_interval > 0.; i++) {
+    ebb_server *server = &group->servers[i];
+    server->balance_watcher.repeat = group->balance_interval;
+    ev_timer_again(server->loop, &server->balance_watcher);
+  }
+
+  for(i = 0; i < nthreads; i++) {
+    ebb_server *server = i < group->nservers ? &group->servers[i] : &group->acceptor;
+    if(0 != pthread_create(&group->threads[i], NULL, run_server, server)) {
+      error("could not start thread %d", i);
+      break;
+    }
+  }
+  group->nthreads = i;
+  group->running = TRUE;
+  if(i < nthreads) {
+    ebb_group_stop(group);
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Breaks the loops of all servers and waits for their threads to
+ * finish. Connections stay open; the loops may be run again with
+ * ebb_group_start.
+ */
+void
+ebb_group_stop(ebb_group *group)
+{
+  int i;
+
+  if(!group->running) return;
+
+  __atomic_store_n(&group->stopping, TRUE, __ATOMIC_RELEASE);
+  for(i = 0; i < group->nthreads; i++) {
+    ebb_server *server = i < group->nservers ? &group->servers[i] : &group->acceptor;
+    ev_async_send(server->loop, &server->async_watcher);
+  }
+  for(i = 0; i < group->nthreads; i++)
+    pthread_join(group->threads[i], NULL);
+
+  group->nthreads = 0;
+  group->running = FALSE;
+}
+
+/**
+ * Stops the group, closes the listening sockets and destroys the loops.
+ * Connections still open are not closed, do that before.
+ */
+void
+ebb_group_destroy(ebb_group *group)
+{
+  int i;
+
+  ebb_group_stop(group);
+  group->destroying = TRUE;
+
+  /* the acceptor first, it posts to the others */
+  if(group->acceptor.loop)
+    destroy_server(&group->acceptor);
+  for(i = 0; i < group->nservers; i++)
+    destroy_server(&group->servers[i]);
+  free(group->servers);
+  free(group->threads);
+  group->servers = NULL;
+  group->threads = NULL;
+  group->nservers = 0;
+  group->acceptor.loop = NULL;
+}
+
+/**
+ * Adds up the counters of the group's servers. Safe to call from any
+ * thread while the group runs; the servers keep counting meanwhile, so
+ * the result is a close approximation rather than a snapshot.
+ */
+void
+ebb_group_stats_get(ebb_group *group, ebb_group_stats *stats)
+{
+  int i;
+
+  memset(stats, 0, sizeof(*stats));
+  for(i = 0; i < group->nservers; i++) {
+    ebb_server *server = &group->servers[i];
+    stats->connections += __atomic_load_n(&server->connection_count, __ATOMIC_RELAXED);
+    stats->accepted += __atomic_load_n(&server->accepted, __ATOMIC_RELAXED);
+    stats->accept_errors += __atomic_load_n(&server->accept_errors, __ATOMIC_RELAXED);
+    stats->requests += __atomic_load_n(&server->requests, __ATOMIC_RELAXED);
+    stats->migrated += __atomic_load_n(&server->migrated, __ATOMIC_RELAXED);
+  }
+  if(group->acceptor.loop) {
+    stats->accepted += __atomic_load_n(&group->acceptor.accepted, __ATOMIC_RELAXED);
+    stats->accept_errors += __atomic_load_n(&group->acceptor.accept_errors, __ATOMIC_RELAXED);
+  }
+}
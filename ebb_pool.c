@@ -0,0 +1,362 @@
+/* This file is part of libebb.
+ *
+ * Copyright (c) 2026 the libebb contributors
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdio.h>      /* perror */
+#include <stdlib.h>
+#include <pthread.h>
+#include <ev.h>
+
+#include "ebb.h"
+
+#ifndef TRUE
+# define TRUE 1
+#endif
+#ifndef FALSE
+# define FALSE 0
+#endif
+
+/* in ebb.c */
+void ebb_connection_finish_close (ebb_connection *connection);
+void ebb_connection_maybe_reset_arena (ebb_connection *connection);
+
+#define error(FORMAT, ...) fprintf(stderr, "error: " FORMAT "\n", ##__VA_ARGS__)
+
+/* Offloaded work. Once fn has run the task goes back to the server as a
+ * message, which makes the done callback.
+ */
+struct task {
+  ebb_message message;
+  ebb_server *server;
+  ebb_connection *connection;
+  ebb_offload_fn fn;
+  void *arg;
+  ebb_connection_cb done;
+  ev_tstamp queued_at;
+  struct task *next;
+};
+
+/* One per thread. The counters are only written by the queue's own
+ * thread, whichever queue the task came from.
+ */
+struct ebb_pool_queue {
+  ebb_pool *pool;
+  int index;
+  pthread_mutex_t lock;
+  struct task *head;
+  struct task *tail;
+  unsigned long completed;
+  unsigned long stolen;
+  unsigned long wait_total;  /* microseconds */
+  unsigned long wait_max;    /* microseconds */
+};
+
+static struct task*
+pop(struct ebb_pool_queue *queue)
+{
+  struct task *task;
+
+  pthread_mutex_lock(&queue->lock);
+  task = queue->head;
+  if(task) {
+    queue->head = task->next;
+    if(queue->head == NULL)
+      queue->tail = NULL;
+  }
+  pthread_mutex_unlock(&queue->lock);
+  return task;
+}
+
+/* The next task from the thread's own queue or, if that is empty,
+ * stolen from another one. Taken from the front in either case so that
+ * tasks start in about the order they were queued.
+ */
+static struct task*
+take(struct ebb_pool_queue *queue)
+{
+  ebb_pool *pool = queue->pool;
+  struct task *task;
+  int i;
+
+  task = pop(queue);
+  for(i = 1; task == NULL && i < pool->nthreads; i++) {
+    task = pop(&pool->queues[(queue->index + i) % pool->nthreads]);
+    if(task)
+      queue->stolen++;
+  }
+  if(task)
+    __atomic_sub_fetch(&pool->queued, 1, __ATOMIC_RELAXED);
+  return task;
+}
+
+static void
+run_task(struct ebb_pool_queue *queue, struct task *task)
+{
+  ebb_pool *pool = queue->pool;
+  unsigned long wait = (unsigned long)((ev_time() - task->queued_at) * 1e6);
+
+  __atomic_add_fetch(&pool->running, 1, __ATOMIC_RELAXED);
+  task->fn(task->arg);
+  __atomic_sub_fetch(&pool->running, 1, __ATOMIC_RELAXED);
+
+  __atomic_store_n(&queue->wait_total, queue->wait_total + wait, __ATOMIC_RELAXED);
+  if(wait > queue->wait_max)
+    __atomic_store_n(&queue->wait_max, wait, __ATOMIC_RELAXED);
+  __atomic_store_n(&queue->completed, queue->completed + 1, __ATOMIC_RELAXED);
+
+  ebb_server_post(task->server, &task->message);
+}
+
+static void*
+run_thread(void *data)
+{
+  struct ebb_pool_queue *queue = data;
+  ebb_pool *pool = queue->pool;
+  struct task *task;
+  int stop;
+
+  for(;;) {
+    if((task = take(queue)) != NULL) {
+      run_task(queue, task);
+      continue;
+    }
+    /* queued is raised before a task is put in a queue, so a task may be
+     * on its way; only sleep when there is none */
+    pthread_mutex_lock(&pool->lock);
+    while(__atomic_load_n(&pool->queued, __ATOMIC_RELAXED) == 0 && !pool->stopping) {
+      pool->sleeping++;
+      pthread_cond_wait(&pool->wakeup, &pool->lock);
+      pool->sleeping--;
+    }
+    stop = pool->stopping && __atomic_load_n(&pool->queued, __ATOMIC_RELAXED) == 0;
+    pthread_mutex_unlock(&pool->lock);
+    if(stop) break;
+  }
+  return NULL;
+}
+
+static int
+submit(ebb_pool *pool, struct task *task)
+{
+  struct ebb_pool_queue *queue;
+
+  if(__atomic_add_fetch(&pool->queued, 1, __ATOMIC_RELAXED) > pool->max_queued) {
+    __atomic_sub_fetch(&pool->queued, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&pool->rejected, 1, __ATOMIC_RELAXED);
+    return -1;
+  }
+
+  task->next = NULL;
+  task->queued_at = ev_time();
+  queue = &pool->queues[__atomic_fetch_add(&pool->next_queue, 1, __ATOMIC_RELAXED) % pool->nthreads];
+  pthread_mutex_lock(&queue->lock);
+  if(queue->tail)
+    queue->tail->next = task;
+  else
+    queue->head = task;
+  queue->tail = task;
+  pthread_mutex_unlock(&queue->lock);
+
+  pthread_mutex_lock(&pool->lock);
+  if(pool->sleeping)
+    pthread_cond_signal(&pool->wakeup);
+  pthread_mutex_unlock(&pool->lock);
+  return 0;
+}
+
+/**
+ * Initialize an ebb_pool and start its nthreads threads; nthreads <= 0
+ * means one per online CPU. Returns 0, or -1 if the threads could not be
+ * started.
+ */
+int
+ebb_pool_init(ebb_pool *pool, int nthreads)
+{
+  int i;
+
+  if(nthreads <= 0)
+    nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  if(nthreads <= 0)
+    nthreads = 1;
+
+  pool->nthreads = 0;
+  pool->next_queue = 0;
+  pool->queued = 0;
+  pool->running = 0;
+  pool->rejected = 0;
+  pool->sleeping = 0;
+  pool->stopping = FALSE;
+  pool->max_queued = EBB_MAX_OFFLOAD_QUEUE;
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->wakeup, NULL);
+
+  pool->threads = calloc(nthreads, sizeof(pthread_t));
+  pool->queues = calloc(nthreads, sizeof(struct ebb_pool_queue));
+  if(pool->threads == NULL || pool->queues == NULL)
+    goto error;
+
+  for(i = 0; i < nthreads; i++) {
+    struct ebb_pool_queue *queue = &pool->queues[i];
+    queue->pool = pool;
+    queue->index = i;
+    pthread_mutex_init(&queue->lock, NULL);
+  }
+  /* threads look at all queues, so only start them once all are there */
+  for(i = 0; i < nthreads; i++) {
+    pool->nthreads = i + 1;
+    if(0 != pthread_create(&pool->threads[i], NULL, run_thread, &pool->queues[i])) {
+      error("could not start pool thread %d", i);
+      pool->nthreads = i;
+      goto error;
+    }
+  }
+  return 0;
+error:
+  ebb_pool_destroy(pool);
+  return -1;
+}
+
+/**
+ * Runs what is still queued, then stops the threads. The done callbacks
+ * of those tasks are only made if the servers' loops run again, so
+ * destroy the pool once no connection has offloaded work left.
+ */
+void
+ebb_pool_destroy(ebb_pool *pool)
+{
+  int i;
+
+  pthread_mutex_lock(&pool->lock);
+  pool->stopping = TRUE;
+  pthread_cond_broadcast(&pool->wakeup);
+  pthread_mutex_unlock(&pool->lock);
+
+  for(i = 0; i < pool->nthreads; i++)
+    pthread_join(pool->threads[i], NULL);
+  for(i = 0; pool->queues && i < pool->nthreads; i++)
+    pthread_mutex_destroy(&pool->queues[i].lock);
+
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->wakeup);
+  free(pool->threads);
+  free(pool->queues);
+  pool->threads = NULL;
+  pool->queues = NULL;
+  pool->nthreads = 0;
+}
+
+/**
+ * Queue depth and wait times of the pool, added up over its threads.
+ * Safe to call from any thread.
+ */
+void
+ebb_pool_stats_get(ebb_pool *pool, ebb_pool_stats *stats)
+{
+  unsigned long wait_total = 0, wait_max;
+  int i;
+
+  memset(stats, 0, sizeof(*stats));
+  stats->queued = __atomic_load_n(&pool->queued, __ATOMIC_RELAXED);
+  stats->running = __atomic_load_n(&pool->running, __ATOMIC_RELAXED);
+  stats->rejected = __atomic_load_n(&pool->rejected, __ATOMIC_RELAXED);
+  for(i = 0; i < pool->nthreads; i++) {
+    struct ebb_pool_queue *queue = &pool->queues[i];
+    stats->completed += __atomic_load_n(&queue->completed, __ATOMIC_RELAXED);
+    stats->stolen += __atomic_load_n(&queue->stolen, __ATOMIC_RELAXED);
+    wait_total += __atomic_load_n(&queue->wait_total, __ATOMIC_RELAXED);
+    wait_max = __atomic_load_n(&queue->wait_max, __ATOMIC_RELAXED);
+    if(wait_max / 1e6 > stats->wait_max)
+      stats->wait_max = wait_max / 1e6;
+  }
+  if(stats->completed > 0)
+    stats->wait_average = wait_total / 1e6 / stats->completed;
+}
+
+/* Internal callback
+ * an offloaded task is back on its server's thread
+ */
+static void
+on_offload_done(ebb_server *server, ebb_message *message)
+{
+  struct task *task = (struct task*)message;
+  ebb_connection *connection = task->connection;
+
+  connection->offloads--;
+  ebb_server_unref(server);
+  if(task->done)
+    task->done(connection, task->arg);
+  ebb_server_free(server, task, sizeof(struct task));
+
+  /* close_connection left this to us */
+  if(!connection->open && connection->offloads == 0)
+    ebb_connection_finish_close(connection);
+  else if(connection->open)
+    ebb_connection_maybe_reset_arena(connection);
+}
+
+/**
+ * Runs fn(arg) on a thread of connection->server->pool, for work that
+ * would block the loop. done(connection, arg) is then called back on
+ * the connection's own thread, where writing to the connection is fine
+ * again. Call this on the connection's thread too.
+ *
+ * done is always called. If the connection was closed in the meantime
+ * connection->open is FALSE and writes fail; its on_close waits until
+ * all offloaded work has come back. Returns 0, or -1 if the server has
+ * no pool or the pool's queue is full.
+ */
+int
+ebb_connection_offload ( ebb_connection *connection
+                       , ebb_offload_fn fn
+                       , void *arg
+                       , ebb_connection_cb done
+                       )
+{
+  ebb_server *server = connection->server;
+  struct task *task;
+
+  if(server->pool == NULL || !connection->open) return -1;
+
+  task = ebb_server_alloc(server, sizeof(struct task));
+  if(task == NULL) return -1;
+  task->message.cb = on_offload_done;
+  task->server = server;
+  task->connection = connection;
+  task->fn = fn;
+  task->arg = arg;
+  task->done = done;
+
+  /* keep the loop running until the task is back */
+  connection->offloads++;
+  ebb_server_ref(server);
+  if(0 > submit(server->pool, task)) {
+    connection->offloads--;
+    ebb_server_unref(server);
+    ebb_server_free(server, task, sizeof(struct task));
+    return -1;
+  }
+  return 0;
+}
@@ -0,0 +1,234 @@
+/* This file is part of libebb.
+ *
+ * Copyright (c) 2026 the libebb contributors
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <stdio.h>      /* perror */
+#include <stdlib.h>
+#include <ev.h>
+
+#include "ebb.h"
+
+#ifndef TRUE
+# define TRUE 1
+#endif
+#ifndef FALSE
+# define FALSE 0
+#endif
+
+#define error(FORMAT, ...) fprintf(stderr, "error: " FORMAT "\n", ##__VA_ARGS__)
+
+/* Forks a worker process. In the child it does not return. */
+static int
+spawn(ebb_prefork_worker *worker)
+{
+  ebb_prefork *prefork = worker->prefork;
+  struct ev_loop *loop = EV_DEFAULT;
+  pid_t pid;
+  int i;
+
+  pid = fork();
+  if(pid < 0) {
+    perror("fork()");
+    return -1;
+  }
+
+  if(pid == 0) {
+    /* the default loop is the worker's now, without the supervisor's
+     * watchers */
+    ev_loop_fork(loop);
+    for(i = 0; i < prefork->nworkers; i++) {
+      ev_child_stop(loop, &prefork->workers[i].child_watcher);
+      ev_timer_stop(loop, &prefork->workers[i].restart_watcher);
+    }
+    prefork->index = worker->index;
+    prefork->on_worker(prefork, worker->index);
+    exit(0);
+  }
+
+  worker->pid = pid;
+  worker->started = ev_time();
+  ev_child_set(&worker->child_watcher, pid, 0);
+  ev_child_start(loop, &worker->child_watcher);
+  return 0;
+}
+
+/* Internal callback
+ * called by worker->child_watcher when the worker exits
+ */
+static void
+on_child(struct ev_loop *loop, ev_child *watcher, int revents)
+{
+  ebb_prefork_worker *worker = watcher->data;
+  ebb_prefork *prefork = worker->prefork;
+  ev_tstamp uptime = ev_time() - worker->started;
+
+  ev_child_stop(loop, watcher);
+  worker->pid = 0;
+  if(prefork->stopping) return;
+
+  if(WIFSIGNALED(watcher->rstatus))
+    error("worker %d (pid %d) killed by signal %d", worker->index, watcher->rpid, WTERMSIG(watcher->rstatus));
+  else
+    error("worker %d (pid %d) exited with %d", worker->index, watcher->rpid, WEXITSTATUS(watcher->rstatus));
+
+  /* a worker which dies right away would likely do so again. don't
+   * fork more often than every EBB_PREFORK_MIN_UPTIME seconds */
+  prefork->restarts++;
+  if(uptime < EBB_PREFORK_MIN_UPTIME) {
+    ev_timer_set(&worker->restart_watcher, EBB_PREFORK_MIN_UPTIME - uptime, 0.);
+    ev_timer_start(loop, &worker->restart_watcher);
+  } else {
+    spawn(worker);
+  }
+}
+
+/* Internal callback
+ * called by worker->restart_watcher
+ */
+static void
+on_restart(struct ev_loop *loop, ev_timer *watcher, int revents)
+{
+  ebb_prefork_worker *worker = watcher->data;
+  spawn(worker);
+}
+
+/**
+ * Initialize an ebb_prefork structure. Set prefork->on_worker afterwards.
+ */
+void
+ebb_prefork_init(ebb_prefork *prefork)
+{
+  prefork->fd = -1;
+  prefork->port[0] = '\0';
+  prefork->nworkers = 0;
+  prefork->workers = NULL;
+  prefork->index = -1;
+  prefork->restarts = 0;
+  prefork->stopping = FALSE;
+  prefork->on_worker = NULL;
+  prefork->data = NULL;
+}
+
+/**
+ * Opens the listening socket the workers will share. Call before
+ * ebb_prefork_start. Returns the file descriptor or -1.
+ */
+int
+ebb_prefork_listen_on_port(ebb_prefork *prefork, const int port)
+{
+  struct sockaddr_in addr;
+  socklen_t len = sizeof(addr);
+  int fd = ebb_bind(port, FALSE);
+
+  if(fd < 0)
+    return -1;
+  if(0 > listen(fd, EBB_MAX_CONNECTIONS)) {
+    perror("listen()");
+    goto error;
+  }
+  if(0 > getsockname(fd, (struct sockaddr *)&addr, &len)) {
+    perror("getsockname");
+    goto error;
+  }
+  sprintf(prefork->port, "%d", ntohs(addr.sin_port));
+  prefork->fd = fd;
+  return fd;
+error:
+  close(fd);
+  return -1;
+}
+
+/**
+ * Forks nworkers worker processes, or one per online CPU if nworkers
+ * <= 0. Each calls prefork->on_worker(prefork, index) and exits when it
+ * returns. A worker normally sets up an ebb_server on the default loop,
+ * passes prefork->fd to ebb_server_listen_on_fd, preferably with
+ * server->exclusive_accept set, and runs the loop.
+ *
+ * The supervisor, the calling process, must run the default loop
+ * afterwards, which restarts workers that die. Returns 0, or -1 if not
+ * all workers could be started.
+ */
+int
+ebb_prefork_start(ebb_prefork *prefork, int nworkers)
+{
+  int i;
+
+  assert(prefork->fd >= 0);
+  assert(prefork->on_worker != NULL);
+
+  if(nworkers <= 0)
+    nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+  if(nworkers <= 0)
+    nworkers = 1;
+
+  prefork->workers = calloc(nworkers, sizeof(ebb_prefork_worker));
+  if(prefork->workers == NULL)
+    return -1;
+  prefork->nworkers = nworkers;
+  prefork->stopping = FALSE;
+
+  for(i = 0; i < nworkers; i++) {
+    ebb_prefork_worker *worker = &prefork->workers[i];
+    worker->prefork = prefork;
+    worker->index = i;
+    worker->pid = 0;
+    ev_child_init(&worker->child_watcher, on_child, 0, 0);
+    worker->child_watcher.data = worker;
+    ev_timer_init(&worker->restart_watcher, on_restart, 0., 0.);
+    worker->restart_watcher.data = worker;
+  }
+  for(i = 0; i < nworkers; i++) {
+    if(0 > spawn(&prefork->workers[i])) {
+      ebb_prefork_stop(prefork);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Sends SIGTERM to the workers and stops restarting them. The default
+ * loop returns once they have all exited, unless it has other watchers.
+ * The listening socket stays open.
+ */
+void
+ebb_prefork_stop(ebb_prefork *prefork)
+{
+  struct ev_loop *loop = EV_DEFAULT;
+  int i;
+
+  prefork->stopping = TRUE;
+  for(i = 0; i < prefork->nworkers; i++) {
+    ebb_prefork_worker *worker = &prefork->workers[i];
+    ev_timer_stop(loop, &worker->restart_watcher);
+    if(worker->pid > 0)
+      kill(worker->pid, SIGTERM);
+  }
+}
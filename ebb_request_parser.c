@@ -30,6 +30,9 @@
 #include "ebb_request_parser.h"
 
 #include <stdio.h>
+#include <string.h>
+#include <strings.h> /* strncasecmp */
+#include <stdint.h>
 #include <assert.h>
 
 static int unhex[] = {-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1
@@ -67,6 +70,14 @@ static int unhex[] = {-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1
                 , CURRENT->number_of_headers        \
                 );                                  \
  }
+/* Elements which are complete but whose action has not fired yet are
+ * handed out at the end of ebb_request_parser_execute(). Reset them so the
+ * pending action doesn't report them a second time. */
+#define FLUSH(CB, FOR)                              \
+  if(parser->FOR##_end >= 0) {                      \
+    CB(FOR);                                        \
+    parser->FOR##_start = parser->FOR##_end = -1;   \
+  }
 #define END_REQUEST                        \
     if(CURRENT && CURRENT->on_complete)               \
       CURRENT->on_complete(CURRENT);       \
@@ -74,11 +85,11 @@ static int unhex[] = {-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1
 
 
 
-#line 310 "ebb_request_parser.rl"
+#line 324 "ebb_request_parser.rl"
 
 
 
-#line 82 "ebb_request_parser.c"
+#line 93 "ebb_request_parser.c"
 static const int ebb_request_parser_start = 183;
 static const int ebb_request_parser_first_final = 183;
 static const int ebb_request_parser_error = 0;
@@ -88,7 +99,7 @@ static const int ebb_request_parser_en_ChunkedBody_chunk_chunk_end = 175;
 static const int ebb_request_parser_en_main = 183;
 
 
-#line 313 "ebb_request_parser.rl"
+#line 327 "ebb_request_parser.rl"
 
 static void
 skip_body(const char **p, ebb_request_parser *parser, size_t nskip) {
@@ -108,22 +119,332 @@ skip_body(const char **p, ebb_request_parser *parser, size_t nskip) {
   }
 }
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__)
+# define SIMD_SCAN 1
+# include <immintrin.h>
+
+static const char*
+find_cr_sse2(const char *p, const char *pe)
+{
+  const __m128i cr = _mm_set1_epi8('\r');
+  for(; pe - p >= 16; p += 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i*)p);
+    int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, cr));
+    if(mask) return p + __builtin_ctz(mask);
+  }
+  while(p < pe && *p != '\r') p++;
+  return p;
+}
+
+__attribute__((target("avx2")))
+static const char*
+find_cr_avx2(const char *p, const char *pe)
+{
+  const __m256i cr = _mm256_set1_epi8('\r');
+  for(; pe - p >= 32; p += 32) {
+    __m256i chunk = _mm256_loadu_si256((const __m256i*)p);
+    unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, cr));
+    if(mask) return p + __builtin_ctz(mask);
+  }
+  return find_cr_sse2(p, pe);
+}
+
+static const char* (*find_cr_simd)(const char *p, const char *pe) = find_cr_sse2;
+
+/* picks find_cr_simd once, when the library is loaded, rather than
+ * asking the CPU on every header value */
+__attribute__((constructor))
+static void
+pick_find_cr(void)
+{
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx2"))
+    find_cr_simd = find_cr_avx2;
+}
+#endif
+
+/* Returns the first CR in [p, pe) or pe. */
+static const char*
+find_cr(const char *p, const char *pe)
+{
+#ifdef SIMD_SCAN
+  return find_cr_simd(p, pe);
+#else
+  const char *cr = memchr(p, '\r', pe - p);
+  return cr ? cr : pe;
+#endif
+}
+
+/* Header values (long cookies, mostly) run up to the CR without any
+ * state change, so the machine is moved there at once instead of taking
+ * one transition per byte. Content-Length, Connection and
+ * Transfer-Encoding are matched by the machine itself while in their
+ * values and are not skipped. Returns where parsing goes on: the CR, pe,
+ * or p for those three.
+ */
+static const char*
+skip_value(ebb_request_parser *parser, const char *p, const char *pe)
+{
+  if(parser->header_id == EBB_HEADER_CONTENT_LENGTH ||
+     parser->header_id == EBB_HEADER_CONNECTION ||
+     parser->header_id == EBB_HEADER_TRANSFER_ENCODING)
+    return p;
+  return find_cr(p, pe);
+}
+
+static unsigned int
+header_hash(const char *field, size_t length)
+{
+  unsigned int h = 0;
+  size_t i;
+  for(i = 0; i < length; i++)
+    h = h * 31 + (field[i] | 0x20); /* ascii lower case */
+  return h;
+}
+
+#define HEADER_IS(NAME, ID) \
+  return 0 == strncasecmp(NAME, field, length) ? ID : EBB_HEADER_OTHER
+
+/* Length and first character rule out nearly every unknown header
+ * before a string comparison is made. */
+static int
+header_id(const char *field, size_t length)
+{
+  char c = field[0] | 0x20; /* ascii lower case */
+
+  switch(length) {
+    case 4:  if(c == 'h') HEADER_IS("host",              EBB_HEADER_HOST);              break;
+    case 5:  if(c == 'r') HEADER_IS("range",             EBB_HEADER_RANGE);             break;
+    case 6:  if(c == 'c') HEADER_IS("cookie",            EBB_HEADER_COOKIE);            break;
+    case 7:  if(c == 'u') HEADER_IS("upgrade",           EBB_HEADER_UPGRADE);           break;
+    case 10: if(c == 'c') HEADER_IS("connection",        EBB_HEADER_CONNECTION);        break;
+    case 12: if(c == 'c') HEADER_IS("content-type",      EBB_HEADER_CONTENT_TYPE);      break;
+    case 13: if(c == 'i') HEADER_IS("if-none-match",     EBB_HEADER_IF_NONE_MATCH);     break;
+    case 14: if(c == 'c') HEADER_IS("content-length",    EBB_HEADER_CONTENT_LENGTH);    break;
+    case 15: if(c == 'a') HEADER_IS("accept-encoding",   EBB_HEADER_ACCEPT_ENCODING);   break;
+    case 17: if(c == 't') HEADER_IS("transfer-encoding", EBB_HEADER_TRANSFER_ENCODING);
+             if(c == 'i') HEADER_IS("if-modified-since", EBB_HEADER_IF_MODIFIED_SINCE);
+             break;
+  }
+  return EBB_HEADER_OTHER;
+}
+
+/* "gzip, deflate;q=0.5, br;q=0" */
+static int
+parse_accept_encoding(const char *at, size_t length)
+{
+  const char *end = at + length;
+  const char *token, *token_end;
+  int encodings = 0;
+  int rejected;
+
+  while(at < end) {
+    while(at < end && (*at == ' ' || *at == '\t' || *at == ',')) at++;
+    token = at;
+    while(at < end && *at != ' ' && *at != '\t' && *at != ',' && *at != ';') at++;
+    token_end = at;
+
+    /* parameters. only q=0 matters. */
+    rejected = FALSE;
+    for(; at < end && *at != ','; at++) {
+      if((*at | 0x20) == 'q' && at + 2 < end && at[1] == '=' && at[2] == '0') {
+        const char *q;
+        rejected = TRUE;
+        for(q = at + 3; q < end && *q != ',' && *q != ';' && *q != ' '; q++)
+          if(*q != '.' && *q != '0') rejected = FALSE;
+      }
+    }
+    if(rejected) continue;
+
+#define TOKEN_IS(S) (token_end - token == sizeof(S) - 1 && 0 == strncasecmp(S, token, sizeof(S) - 1))
+    if(TOKEN_IS("gzip") || TOKEN_IS("x-gzip"))
+      encodings |= EBB_ACCEPT_GZIP;
+    else if(TOKEN_IS("deflate"))
+      encodings |= EBB_ACCEPT_DEFLATE;
+    else if(TOKEN_IS("br"))
+      encodings |= EBB_ACCEPT_BR;
+    else if(TOKEN_IS("*"))
+      encodings |= EBB_ACCEPT_ANY;
+#undef TOKEN_IS
+  }
+  return encodings;
+}
+
+/* days since 1970-01-01 in the proleptic gregorian calendar */
+static long
+days_from_civil(long y, int m, int d)
+{
+  long era, yoe, doy, doe;
+  y -= m <= 2;
+  era = (y >= 0 ? y : y - 399) / 400;
+  yoe = y - era * 400;
+  doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+  doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  return era * 146097 + doe - 719468;
+}
+
+static int
+days_in_month(int year, int month)
+{
+  static const int days[] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+  if(month == 1 && year % 4 == 0 && (year % 100 != 0 || year % 400 == 0))
+    return 29;
+  return days[month];
+}
+
+static int
+two_digits(const char *at)
+{
+  if(at[0] < '0' || at[0] > '9' || at[1] < '0' || at[1] > '9') return -1;
+  return (at[0] - '0') * 10 + (at[1] - '0');
+}
+
+/* "Sun, 06 Nov 1994 08:49:37 GMT" - RFC 1123, the only format servers
+ * are required to send. The obsolete formats give -1. */
+static time_t
+parse_http_date(const char *at, size_t length)
+{
+  static const char months[] = "janfebmaraprmayjunjulaugsepoctnovdec";
+  int day, month, century, year, hour, minute, second;
+
+  if(length != 29 || at[3] != ',' || at[4] != ' ' || at[7] != ' ' ||
+      at[11] != ' ' || at[16] != ' ' || at[19] != ':' || at[22] != ':' ||
+      0 != strncmp(at + 25, " GMT", 4))
+    return -1;
+
+  for(month = 0; month < 12; month++) {
+    if(months[3*month] == (at[8] | 0x20) &&
+        months[3*month + 1] == (at[9] | 0x20) &&
+        months[3*month + 2] == (at[10] | 0x20))
+      break;
+  }
+  day = two_digits(at + 5);
+  century = two_digits(at + 12);
+  year = two_digits(at + 14);
+  hour = two_digits(at + 17);
+  minute = two_digits(at + 20);
+  second = two_digits(at + 23);
+  if(month == 12 || century < 0 || year < 0 || day < 1 ||
+      day > days_in_month(century * 100 + year, month) ||
+      hour < 0 || hour > 23 || minute < 0 || minute > 59 ||
+      second < 0 || second > 60)
+    return -1;
+
+  return (time_t)days_from_civil(century * 100 + year, month + 1, day) * 86400
+       + hour * 3600 + minute * 60 + second;
+}
+
+#define OFF_T_MAX ((off_t)(((uint64_t)1 << (sizeof(off_t) * 8 - 1)) - 1))
+
+/* "bytes=0-499", "bytes=500-", "bytes=-500". Only the first range of a
+ * list is looked at. Numbers too large for off_t make it invalid. */
+static void
+parse_range(ebb_request *request, const char *at, size_t length)
+{
+  const char *end = at + length;
+  off_t start = -1, stop = -1;
+
+  if(length < 7 || 0 != strncasecmp("bytes=", at, 6))
+    return;
+  for(at += 6; at < end && *at >= '0' && *at <= '9'; at++) {
+    if(start > (OFF_T_MAX - 9) / 10) return;
+    start = (start < 0 ? 0 : start * 10) + (*at - '0');
+  }
+  if(at == end || *at != '-')
+    return;
+  for(at++; at < end && *at >= '0' && *at <= '9'; at++) {
+    if(stop > (OFF_T_MAX - 9) / 10) return;
+    stop = (stop < 0 ? 0 : stop * 10) + (*at - '0');
+  }
+  if(at != end && *at != ',' && *at != ' ')
+    return;
+  if(start < 0 && stop < 0)
+    return;
+  if(start >= 0 && stop >= 0 && stop < start)
+    return;
+
+  request->range_start = start;
+  request->range_end = stop;
+}
+
+static void
+store_header_field(ebb_request_parser *parser, const char *buf)
+{
+  ebb_request *request = CURRENT;
+  const char *field = buf + parser->header_field_start;
+  size_t length = parser->header_field_end - parser->header_field_start;
+
+  if(request == NULL) return;
+
+  parser->header_id = header_id(field, length);
+  /* remembered as offsets so that ebb_request_parser_relocate() can
+   * move them. headers[] gets the field with its value. */
+  parser->stored_field_start = parser->header_field_start;
+  parser->stored_field_end = parser->header_field_end;
+}
+
+static void
+store_header_value(ebb_request_parser *parser, const char *buf)
+{
+  ebb_request *request = CURRENT;
+  const char *value = buf + parser->header_value_start;
+  size_t length = parser->header_value_end - parser->header_value_start;
+  int id = parser->header_id;
+
+  if(request == NULL) return;
+
+  if(id != EBB_HEADER_OTHER && request->known_headers[id] == NULL) {
+    request->known_headers[id] = value;
+    request->known_header_lengths[id] = length;
+
+    switch(id) {
+      case EBB_HEADER_ACCEPT_ENCODING:
+        request->accept_encoding = parse_accept_encoding(value, length);
+        break;
+      case EBB_HEADER_IF_MODIFIED_SINCE:
+        request->if_modified_since = parse_http_date(value, length);
+        break;
+      case EBB_HEADER_RANGE:
+        parse_range(request, value, length);
+        break;
+    }
+  }
+
+  if(request->store_headers && request->number_of_headers < EBB_MAX_HEADERS) {
+    ebb_header *header = &request->headers[request->number_of_headers];
+    header->field = buf + parser->stored_field_start;
+    header->field_length = parser->stored_field_end - parser->stored_field_start;
+    header->value = value;
+    header->value_length = length;
+    header->id = id;
+
+    /* open addressing, the first header with a given name wins */
+    unsigned int slot = header_hash(header->field, header->field_length) % EBB_HEADER_SLOTS;
+    while(request->header_slots[slot] != 0)
+      slot = (slot + 1) % EBB_HEADER_SLOTS;
+    request->header_slots[slot] = request->number_of_headers + 1;
+  }
+}
+
 void ebb_request_parser_init(ebb_request_parser *parser) 
 {
   int cs = 0;
   
-#line 116 "ebb_request_parser.c"
+#line 434 "ebb_request_parser.c"
 	{
 	cs = ebb_request_parser_start;
 	}
 
-#line 336 "ebb_request_parser.rl"
+#line 657 "ebb_request_parser.rl"
   parser->cs = cs;
 
   parser->chunk_size = 0;
   parser->eating = 0;
   
   parser->current_request = NULL;
+  parser->header_id = EBB_HEADER_OTHER;
+  parser->request_start = parser->headers_end = -1;
+  parser->stored_field_start = parser->stored_field_end = -1;
 
   parser->header_field_start = parser->header_field_end = -1;
   parser->header_value_start = parser->header_value_end = -1;
@@ -155,8 +476,12 @@ size_t ebb_request_parser_execute(ebb_request_parser *parser, const char *buffer
     skip_body(&p, parser, eat);
   } 
 
+  /* the last buffer ended inside a header value */
+  if(parser->header_value_start >= 0 && parser->header_value_end < 0)
+    p = skip_value(parser, p, pe);
+
   
-#line 160 "ebb_request_parser.c"
+#line 485 "ebb_request_parser.c"
 	{
 	if ( p == pe )
 		goto _test_eof;
@@ -359,12 +684,13 @@ _resume:
 	{
 tr25:
 	cs = 183;
-#line 164 "ebb_request_parser.rl"
+#line 175 "ebb_request_parser.rl"
 	{
+    parser->headers_end = p - buf + 1;
     if(CURRENT && CURRENT->on_headers_complete)
       CURRENT->on_headers_complete(CURRENT);
   }
-#line 194 "ebb_request_parser.rl"
+#line 208 "ebb_request_parser.rl"
 	{
     if(CURRENT) { 
       if(CURRENT->transfer_encoding == EBB_CHUNKED) {
@@ -386,7 +712,7 @@ st183:
 	if ( ++p == pe )
 		goto _test_eof183;
 case 183:
-#line 390 "ebb_request_parser.c"
+#line 716 "ebb_request_parser.c"
 	switch( (*p) ) {
 		case 67: goto tr218;
 		case 68: goto tr219;
@@ -404,17 +730,19 @@ st0:
 cs = 0;
 	goto _out;
 tr218:
-#line 189 "ebb_request_parser.rl"
+#line 201 "ebb_request_parser.rl"
 	{
     assert(CURRENT == NULL);
     CURRENT = parser->new_request(parser->data);
+    parser->request_start = p - buf;
+    parser->headers_end = -1;
   }
 	goto st1;
 st1:
 	if ( ++p == pe )
 		goto _test_eof1;
 case 1:
-#line 418 "ebb_request_parser.c"
+#line 746 "ebb_request_parser.c"
 	if ( (*p) == 79 )
 		goto st2;
 	goto st0;
@@ -440,66 +768,66 @@ case 4:
 		goto tr4;
 	goto st0;
 tr4:
-#line 243 "ebb_request_parser.rl"
+#line 257 "ebb_request_parser.rl"
 	{ if(CURRENT) CURRENT->method = EBB_COPY;      }
 	goto st5;
 tr139:
-#line 244 "ebb_request_parser.rl"
+#line 258 "ebb_request_parser.rl"
 	{ if(CURRENT) CURRENT->method = EBB_DELETE;    }
 	goto st5;
 tr142:
-#line 245 "ebb_request_parser.rl"
+#line 259 "ebb_request_parser.rl"
 	{ if(CURRENT) CURRENT->method = EBB_GET;       }
 	goto st5;
 tr146:
-#line 246 "ebb_request_parser.rl"
+#line 260 "ebb_request_parser.rl"
 	{ if(CURRENT) CURRENT->method = EBB_HEAD;      }
 	goto st5;
 tr150:
-#line 247 "ebb_request_parser.rl"
+#line 261 "ebb_request_parser.rl"
 	{ if(CURRENT) CURRENT->method = EBB_LOCK;      }
 	goto st5;
 tr156:
-#line 248 "ebb_request_parser.rl"
+#line 262 "ebb_request_parser.rl"
 	{ if(CURRENT) CURRENT->method = EBB_MKCOL;     }
 	goto st5;
 tr159:
-#line 249 "ebb_request_parser.rl"
+#line 263 "ebb_request_parser.rl"
 	{ if(CURRENT) CURRENT->method = EBB_MOVE;      }
 	goto st5;
 tr166:
-#line 250 "ebb_request_parser.rl"
+#line 264 "ebb_request_parser.rl"
 	{ if(CURRENT) CURRENT->method = EBB_OPTIONS;   }
 	goto st5;
 tr172:
-#line 251 "ebb_request_parser.rl"
+#line 265 "ebb_request_parser.rl"
 	{ if(CURRENT) CURRENT->method = EBB_POST;      }
 	goto st5;
 tr180:
-#line 252 "ebb_request_parser.rl"
+#line 266 "ebb_request_parser.rl"
 	{ if(CURRENT) CURRENT->method = EBB_PROPFIND;  }
 	goto st5;
 tr185:
-#line 253 "ebb_request_parser.rl"
+#line 267 "ebb_request_parser.rl"
 	{ if(CURRENT) CURRENT->method = EBB_PROPPATCH; }
 	goto st5;
 tr187:
-#line 254 "ebb_request_parser.rl"
+#line 268 "ebb_request_parser.rl"
 	{ if(CURRENT) CURRENT->method = EBB_PUT;       }
 	goto st5;
 tr192:
-#line 255 "ebb_request_parser.rl"
+#line 269 "ebb_request_parser.rl"
 	{ if(CURRENT) CURRENT->method = EBB_TRACE;     }
 	goto st5;
 tr198:
-#line 256 "ebb_request_parser.rl"
+#line 270 "ebb_request_parser.rl"
 	{ if(CURRENT) CURRENT->method = EBB_UNLOCK;    }
 	goto st5;
 st5:
 	if ( ++p == pe )
 		goto _test_eof5;
 case 5:
-#line 503 "ebb_request_parser.c"
+#line 831 "ebb_request_parser.c"
 	switch( (*p) ) {
 		case 42: goto tr5;
 		case 43: goto tr6;
@@ -516,98 +844,98 @@ case 5:
 		goto tr6;
 	goto st0;
 tr5:
-#line 92 "ebb_request_parser.rl"
+#line 103 "ebb_request_parser.rl"
 	{ parser->uri_start           = p - buf; }
 	goto st6;
 st6:
 	if ( ++p == pe )
 		goto _test_eof6;
 case 6:
-#line 527 "ebb_request_parser.c"
+#line 855 "ebb_request_parser.c"
 	switch( (*p) ) {
 		case 32: goto tr9;
 		case 35: goto tr10;
 	}
 	goto st0;
 tr9:
-#line 93 "ebb_request_parser.rl"
+#line 104 "ebb_request_parser.rl"
 	{ parser->uri_end             = p - buf; }
 	goto st7;
 tr109:
-#line 83 "ebb_request_parser.rl"
+#line 94 "ebb_request_parser.rl"
 	{ parser->fragment_start      = p - buf; }
-#line 84 "ebb_request_parser.rl"
+#line 95 "ebb_request_parser.rl"
 	{ parser->fragment_end        = p - buf; }
-#line 110 "ebb_request_parser.rl"
+#line 121 "ebb_request_parser.rl"
 	{ 
     CALLBACK(fragment);
-    parser->fragment_start = -1;
+    parser->fragment_start = parser->fragment_end = -1;
   }
 	goto st7;
 tr112:
-#line 84 "ebb_request_parser.rl"
+#line 95 "ebb_request_parser.rl"
 	{ parser->fragment_end        = p - buf; }
-#line 110 "ebb_request_parser.rl"
+#line 121 "ebb_request_parser.rl"
 	{ 
     CALLBACK(fragment);
-    parser->fragment_start = -1;
+    parser->fragment_start = parser->fragment_end = -1;
   }
 	goto st7;
 tr120:
-#line 90 "ebb_request_parser.rl"
+#line 101 "ebb_request_parser.rl"
 	{ parser->path_end            = p - buf; }
-#line 93 "ebb_request_parser.rl"
+#line 104 "ebb_request_parser.rl"
 	{ parser->uri_end             = p - buf; }
 	goto st7;
 tr126:
-#line 86 "ebb_request_parser.rl"
+#line 97 "ebb_request_parser.rl"
 	{ parser->query_string_start  = p - buf; }
-#line 87 "ebb_request_parser.rl"
+#line 98 "ebb_request_parser.rl"
 	{ parser->query_string_end    = p - buf; }
-#line 115 "ebb_request_parser.rl"
+#line 126 "ebb_request_parser.rl"
 	{ 
     CALLBACK(query_string);
-    parser->query_string_start = -1;
+    parser->query_string_start = parser->query_string_end = -1;
   }
-#line 93 "ebb_request_parser.rl"
+#line 104 "ebb_request_parser.rl"
 	{ parser->uri_end             = p - buf; }
 	goto st7;
 tr130:
-#line 87 "ebb_request_parser.rl"
+#line 98 "ebb_request_parser.rl"
 	{ parser->query_string_end    = p - buf; }
-#line 115 "ebb_request_parser.rl"
+#line 126 "ebb_request_parser.rl"
 	{ 
     CALLBACK(query_string);
-    parser->query_string_start = -1;
+    parser->query_string_start = parser->query_string_end = -1;
   }
-#line 93 "ebb_request_parser.rl"
+#line 104 "ebb_request_parser.rl"
 	{ parser->uri_end             = p - buf; }
 	goto st7;
 st7:
 	if ( ++p == pe )
 		goto _test_eof7;
 case 7:
-#line 591 "ebb_request_parser.c"
+#line 919 "ebb_request_parser.c"
 	if ( (*p) == 72 )
 		goto tr11;
 	goto st0;
 tr11:
-#line 120 "ebb_request_parser.rl"
+#line 131 "ebb_request_parser.rl"
 	{
     CALLBACK(path);
     parser->path_start = parser->path_end = -1;
   }
-#line 105 "ebb_request_parser.rl"
+#line 116 "ebb_request_parser.rl"
 	{ 
     CALLBACK(uri);
-    parser->uri_start = -1;
+    parser->uri_start = parser->uri_end = -1;
   }
 	goto st8;
 st8:
 	if ( ++p == pe )
 		goto _test_eof8;
 case 8:
-#line 611 "ebb_request_parser.c"
+#line 939 "ebb_request_parser.c"
 	if ( (*p) == 84 )
 		goto st9;
 	goto st0;
@@ -640,7 +968,7 @@ case 12:
 		goto tr16;
 	goto st0;
 tr16:
-#line 146 "ebb_request_parser.rl"
+#line 157 "ebb_request_parser.rl"
 	{
     if(CURRENT) {
       CURRENT->version_major *= 10;
@@ -652,7 +980,7 @@ st13:
 	if ( ++p == pe )
 		goto _test_eof13;
 case 13:
-#line 656 "ebb_request_parser.c"
+#line 984 "ebb_request_parser.c"
 	if ( (*p) == 46 )
 		goto st14;
 	if ( 48 <= (*p) && (*p) <= 57 )
@@ -666,7 +994,7 @@ case 14:
 		goto tr18;
 	goto st0;
 tr18:
-#line 153 "ebb_request_parser.rl"
+#line 164 "ebb_request_parser.rl"
 	{
   	if(CURRENT) {
       CURRENT->version_minor *= 10;
@@ -678,7 +1006,7 @@ st15:
 	if ( ++p == pe )
 		goto _test_eof15;
 case 15:
-#line 682 "ebb_request_parser.c"
+#line 1010 "ebb_request_parser.c"
 	if ( (*p) == 13 )
 		goto st16;
 	if ( 48 <= (*p) && (*p) <= 57 )
@@ -724,17 +1052,17 @@ case 17:
 		goto tr22;
 	goto st0;
 tr34:
-#line 95 "ebb_request_parser.rl"
+#line 106 "ebb_request_parser.rl"
 	{ 
     HEADER_CALLBACK(header_field);
-    parser->header_field_start = -1;
+    parser->header_field_start = parser->header_field_end = -1;
   }
-#line 100 "ebb_request_parser.rl"
+#line 111 "ebb_request_parser.rl"
 	{
     HEADER_CALLBACK(header_value);
-    parser->header_value_start = -1;
+    parser->header_value_start = parser->header_value_end = -1;
   }
-#line 160 "ebb_request_parser.rl"
+#line 171 "ebb_request_parser.rl"
 	{
     if(CURRENT) CURRENT->number_of_headers++;
   }
@@ -743,37 +1071,37 @@ st18:
 	if ( ++p == pe )
 		goto _test_eof18;
 case 18:
-#line 747 "ebb_request_parser.c"
+#line 1075 "ebb_request_parser.c"
 	if ( (*p) == 10 )
 		goto tr25;
 	goto st0;
 tr22:
-#line 77 "ebb_request_parser.rl"
+#line 88 "ebb_request_parser.rl"
 	{ parser->header_field_start  = p - buf; }
 	goto st19;
 tr35:
-#line 95 "ebb_request_parser.rl"
+#line 106 "ebb_request_parser.rl"
 	{ 
     HEADER_CALLBACK(header_field);
-    parser->header_field_start = -1;
+    parser->header_field_start = parser->header_field_end = -1;
   }
-#line 100 "ebb_request_parser.rl"
+#line 111 "ebb_request_parser.rl"
 	{
     HEADER_CALLBACK(header_value);
-    parser->header_value_start = -1;
+    parser->header_value_start = parser->header_value_end = -1;
   }
-#line 160 "ebb_request_parser.rl"
+#line 171 "ebb_request_parser.rl"
 	{
     if(CURRENT) CURRENT->number_of_headers++;
   }
-#line 77 "ebb_request_parser.rl"
+#line 88 "ebb_request_parser.rl"
 	{ parser->header_field_start  = p - buf; }
 	goto st19;
 st19:
 	if ( ++p == pe )
 		goto _test_eof19;
 case 19:
-#line 777 "ebb_request_parser.c"
+#line 1105 "ebb_request_parser.c"
 	switch( (*p) ) {
 		case 33: goto st19;
 		case 58: goto tr27;
@@ -799,64 +1127,64 @@ case 19:
 		goto st19;
 	goto st0;
 tr27:
-#line 78 "ebb_request_parser.rl"
-	{ parser->header_field_end    = p - buf; }
+#line 89 "ebb_request_parser.rl"
+	{ parser->header_field_end    = p - buf; store_header_field(parser, buf); }
 	goto st20;
 st20:
 	if ( ++p == pe )
 		goto _test_eof20;
 case 20:
-#line 810 "ebb_request_parser.c"
+#line 1138 "ebb_request_parser.c"
 	switch( (*p) ) {
 		case 13: goto tr29;
 		case 32: goto st20;
 	}
 	goto tr28;
 tr28:
-#line 80 "ebb_request_parser.rl"
-	{ parser->header_value_start  = p - buf; }
+#line 91 "ebb_request_parser.rl"
+	{ parser->header_value_start  = p - buf; if(*p != '\r') p = skip_value(parser, p + 1, pe) - 1; }
 	goto st21;
 st21:
 	if ( ++p == pe )
 		goto _test_eof21;
 case 21:
-#line 824 "ebb_request_parser.c"
+#line 1152 "ebb_request_parser.c"
 	if ( (*p) == 13 )
 		goto tr32;
 	goto st21;
 tr29:
-#line 80 "ebb_request_parser.rl"
-	{ parser->header_value_start  = p - buf; }
-#line 81 "ebb_request_parser.rl"
-	{ parser->header_value_end    = p - buf; }
+#line 91 "ebb_request_parser.rl"
+	{ parser->header_value_start  = p - buf; if(*p != '\r') p = skip_value(parser, p + 1, pe) - 1; }
+#line 92 "ebb_request_parser.rl"
+	{ parser->header_value_end    = p - buf; store_header_value(parser, buf); }
 	goto st22;
 tr32:
-#line 81 "ebb_request_parser.rl"
-	{ parser->header_value_end    = p - buf; }
+#line 92 "ebb_request_parser.rl"
+	{ parser->header_value_end    = p - buf; store_header_value(parser, buf); }
 	goto st22;
 tr56:
-#line 136 "ebb_request_parser.rl"
+#line 147 "ebb_request_parser.rl"
 	{ if(CURRENT) CURRENT->keep_alive = FALSE; }
-#line 81 "ebb_request_parser.rl"
-	{ parser->header_value_end    = p - buf; }
+#line 92 "ebb_request_parser.rl"
+	{ parser->header_value_end    = p - buf; store_header_value(parser, buf); }
 	goto st22;
 tr66:
-#line 135 "ebb_request_parser.rl"
+#line 146 "ebb_request_parser.rl"
 	{ if(CURRENT) CURRENT->keep_alive = TRUE; }
-#line 81 "ebb_request_parser.rl"
-	{ parser->header_value_end    = p - buf; }
+#line 92 "ebb_request_parser.rl"
+	{ parser->header_value_end    = p - buf; store_header_value(parser, buf); }
 	goto st22;
 tr107:
-#line 132 "ebb_request_parser.rl"
+#line 143 "ebb_request_parser.rl"
 	{ if(CURRENT) CURRENT->transfer_encoding = EBB_IDENTITY; }
-#line 81 "ebb_request_parser.rl"
-	{ parser->header_value_end    = p - buf; }
+#line 92 "ebb_request_parser.rl"
+	{ parser->header_value_end    = p - buf; store_header_value(parser, buf); }
 	goto st22;
 st22:
 	if ( ++p == pe )
 		goto _test_eof22;
 case 22:
-#line 860 "ebb_request_parser.c"
+#line 1188 "ebb_request_parser.c"
 	if ( (*p) == 10 )
 		goto st23;
 	goto st0;
@@ -893,32 +1221,32 @@ case 23:
 		goto tr35;
 	goto st0;
 tr23:
-#line 77 "ebb_request_parser.rl"
+#line 88 "ebb_request_parser.rl"
 	{ parser->header_field_start  = p - buf; }
 	goto st24;
 tr36:
-#line 95 "ebb_request_parser.rl"
+#line 106 "ebb_request_parser.rl"
 	{ 
     HEADER_CALLBACK(header_field);
-    parser->header_field_start = -1;
+    parser->header_field_start = parser->header_field_end = -1;
   }
-#line 100 "ebb_request_parser.rl"
+#line 111 "ebb_request_parser.rl"
 	{
     HEADER_CALLBACK(header_value);
-    parser->header_value_start = -1;
+    parser->header_value_start = parser->header_value_end = -1;
   }
-#line 160 "ebb_request_parser.rl"
+#line 171 "ebb_request_parser.rl"
 	{
     if(CURRENT) CURRENT->number_of_headers++;
   }
-#line 77 "ebb_request_parser.rl"
+#line 88 "ebb_request_parser.rl"
 	{ parser->header_field_start  = p - buf; }
 	goto st24;
 st24:
 	if ( ++p == pe )
 		goto _test_eof24;
 case 24:
-#line 922 "ebb_request_parser.c"
+#line 1250 "ebb_request_parser.c"
 	switch( (*p) ) {
 		case 33: goto st19;
 		case 58: goto tr27;
@@ -1216,14 +1544,14 @@ case 33:
 		goto st19;
 	goto st0;
 tr48:
-#line 78 "ebb_request_parser.rl"
-	{ parser->header_field_end    = p - buf; }
+#line 89 "ebb_request_parser.rl"
+	{ parser->header_field_end    = p - buf; store_header_field(parser, buf); }
 	goto st34;
 st34:
 	if ( ++p == pe )
 		goto _test_eof34;
 case 34:
-#line 1227 "ebb_request_parser.c"
+#line 1555 "ebb_request_parser.c"
 	switch( (*p) ) {
 		case 13: goto tr29;
 		case 32: goto st34;
@@ -1234,14 +1562,14 @@ case 34:
 	}
 	goto tr28;
 tr50:
-#line 80 "ebb_request_parser.rl"
-	{ parser->header_value_start  = p - buf; }
+#line 91 "ebb_request_parser.rl"
+	{ parser->header_value_start  = p - buf; if(*p != '\r') p = skip_value(parser, p + 1, pe) - 1; }
 	goto st35;
 st35:
 	if ( ++p == pe )
 		goto _test_eof35;
 case 35:
-#line 1245 "ebb_request_parser.c"
+#line 1573 "ebb_request_parser.c"
 	switch( (*p) ) {
 		case 13: goto tr32;
 		case 76: goto st36;
@@ -1286,14 +1614,14 @@ case 39:
 		goto tr56;
 	goto st21;
 tr51:
-#line 80 "ebb_request_parser.rl"
-	{ parser->header_value_start  = p - buf; }
+#line 91 "ebb_request_parser.rl"
+	{ parser->header_value_start  = p - buf; if(*p != '\r') p = skip_value(parser, p + 1, pe) - 1; }
 	goto st40;
 st40:
 	if ( ++p == pe )
 		goto _test_eof40;
 case 40:
-#line 1297 "ebb_request_parser.c"
+#line 1625 "ebb_request_parser.c"
 	switch( (*p) ) {
 		case 13: goto tr32;
 		case 69: goto st41;
@@ -1712,14 +2040,14 @@ case 60:
 		goto st19;
 	goto st0;
 tr77:
-#line 78 "ebb_request_parser.rl"
-	{ parser->header_field_end    = p - buf; }
+#line 89 "ebb_request_parser.rl"
+	{ parser->header_field_end    = p - buf; store_header_field(parser, buf); }
 	goto st61;
 st61:
 	if ( ++p == pe )
 		goto _test_eof61;
 case 61:
-#line 1723 "ebb_request_parser.c"
+#line 2051 "ebb_request_parser.c"
 	switch( (*p) ) {
 		case 13: goto tr29;
 		case 32: goto st61;
@@ -1728,18 +2056,18 @@ case 61:
 		goto tr79;
 	goto tr28;
 tr79:
-#line 125 "ebb_request_parser.rl"
+#line 136 "ebb_request_parser.rl"
 	{
     if(CURRENT){
       CURRENT->content_length *= 10;
       CURRENT->content_length += *p - '0';
     }
   }
-#line 80 "ebb_request_parser.rl"
-	{ parser->header_value_start  = p - buf; }
+#line 91 "ebb_request_parser.rl"
+	{ parser->header_value_start  = p - buf; if(*p != '\r') p = skip_value(parser, p + 1, pe) - 1; }
 	goto st62;
 tr80:
-#line 125 "ebb_request_parser.rl"
+#line 136 "ebb_request_parser.rl"
 	{
     if(CURRENT){
       CURRENT->content_length *= 10;
@@ -1751,39 +2079,39 @@ st62:
 	if ( ++p == pe )
 		goto _test_eof62;
 case 62:
-#line 1755 "ebb_request_parser.c"
+#line 2083 "ebb_request_parser.c"
 	if ( (*p) == 13 )
 		goto tr32;
 	if ( 48 <= (*p) && (*p) <= 57 )
 		goto tr80;
 	goto st21;
 tr24:
-#line 77 "ebb_request_parser.rl"
+#line 88 "ebb_request_parser.rl"
 	{ parser->header_field_start  = p - buf; }
 	goto st63;
 tr37:
-#line 95 "ebb_request_parser.rl"
+#line 106 "ebb_request_parser.rl"
 	{ 
     HEADER_CALLBACK(header_field);
-    parser->header_field_start = -1;
+    parser->header_field_start = parser->header_field_end = -1;
   }
-#line 100 "ebb_request_parser.rl"
+#line 111 "ebb_request_parser.rl"
 	{
     HEADER_CALLBACK(header_value);
-    parser->header_value_start = -1;
+    parser->header_value_start = parser->header_value_end = -1;
   }
-#line 160 "ebb_request_parser.rl"
+#line 171 "ebb_request_parser.rl"
 	{
     if(CURRENT) CURRENT->number_of_headers++;
   }
-#line 77 "ebb_request_parser.rl"
+#line 88 "ebb_request_parser.rl"
 	{ parser->header_field_start  = p - buf; }
 	goto st63;
 st63:
 	if ( ++p == pe )
 		goto _test_eof63;
 case 63:
-#line 1787 "ebb_request_parser.c"
+#line 2115 "ebb_request_parser.c"
 	switch( (*p) ) {
 		case 33: goto st19;
 		case 58: goto tr27;
@@ -2286,16 +2614,16 @@ case 79:
 		goto st19;
 	goto st0;
 tr97:
-#line 133 "ebb_request_parser.rl"
+#line 144 "ebb_request_parser.rl"
 	{ if(CURRENT) CURRENT->transfer_encoding = EBB_CHUNKED; }
-#line 78 "ebb_request_parser.rl"
-	{ parser->header_field_end    = p - buf; }
+#line 89 "ebb_request_parser.rl"
+	{ parser->header_field_end    = p - buf; store_header_field(parser, buf); }
 	goto st80;
 st80:
 	if ( ++p == pe )
 		goto _test_eof80;
 case 80:
-#line 2299 "ebb_request_parser.c"
+#line 2627 "ebb_request_parser.c"
 	switch( (*p) ) {
 		case 13: goto tr29;
 		case 32: goto st80;
@@ -2303,14 +2631,14 @@ case 80:
 	}
 	goto tr28;
 tr99:
-#line 80 "ebb_request_parser.rl"
-	{ parser->header_value_start  = p - buf; }
+#line 91 "ebb_request_parser.rl"
+	{ parser->header_value_start  = p - buf; if(*p != '\r') p = skip_value(parser, p + 1, pe) - 1; }
 	goto st81;
 st81:
 	if ( ++p == pe )
 		goto _test_eof81;
 case 81:
-#line 2314 "ebb_request_parser.c"
+#line 2642 "ebb_request_parser.c"
 	switch( (*p) ) {
 		case 13: goto tr32;
 		case 100: goto st82;
@@ -2378,44 +2706,44 @@ case 88:
 		goto tr107;
 	goto st21;
 tr10:
-#line 93 "ebb_request_parser.rl"
+#line 104 "ebb_request_parser.rl"
 	{ parser->uri_end             = p - buf; }
 	goto st89;
 tr121:
-#line 90 "ebb_request_parser.rl"
+#line 101 "ebb_request_parser.rl"
 	{ parser->path_end            = p - buf; }
-#line 93 "ebb_request_parser.rl"
+#line 104 "ebb_request_parser.rl"
 	{ parser->uri_end             = p - buf; }
 	goto st89;
 tr127:
-#line 86 "ebb_request_parser.rl"
+#line 97 "ebb_request_parser.rl"
 	{ parser->query_string_start  = p - buf; }
-#line 87 "ebb_request_parser.rl"
+#line 98 "ebb_request_parser.rl"
 	{ parser->query_string_end    = p - buf; }
-#line 115 "ebb_request_parser.rl"
+#line 126 "ebb_request_parser.rl"
 	{ 
     CALLBACK(query_string);
-    parser->query_string_start = -1;
+    parser->query_string_start = parser->query_string_end = -1;
   }
-#line 93 "ebb_request_parser.rl"
+#line 104 "ebb_request_parser.rl"
 	{ parser->uri_end             = p - buf; }
 	goto st89;
 tr131:
-#line 87 "ebb_request_parser.rl"
+#line 98 "ebb_request_parser.rl"
 	{ parser->query_string_end    = p - buf; }
-#line 115 "ebb_request_parser.rl"
+#line 126 "ebb_request_parser.rl"
 	{ 
     CALLBACK(query_string);
-    parser->query_string_start = -1;
+    parser->query_string_start = parser->query_string_end = -1;
   }
-#line 93 "ebb_request_parser.rl"
+#line 104 "ebb_request_parser.rl"
 	{ parser->uri_end             = p - buf; }
 	goto st89;
 st89:
 	if ( ++p == pe )
 		goto _test_eof89;
 case 89:
-#line 2419 "ebb_request_parser.c"
+#line 2747 "ebb_request_parser.c"
 	switch( (*p) ) {
 		case 32: goto tr109;
 		case 37: goto tr110;
@@ -2430,14 +2758,14 @@ case 89:
 		goto st0;
 	goto tr108;
 tr108:
-#line 83 "ebb_request_parser.rl"
+#line 94 "ebb_request_parser.rl"
 	{ parser->fragment_start      = p - buf; }
 	goto st90;
 st90:
 	if ( ++p == pe )
 		goto _test_eof90;
 case 90:
-#line 2441 "ebb_request_parser.c"
+#line 2769 "ebb_request_parser.c"
 	switch( (*p) ) {
 		case 32: goto tr112;
 		case 37: goto st91;
@@ -2452,14 +2780,14 @@ case 90:
 		goto st0;
 	goto st90;
 tr110:
-#line 83 "ebb_request_parser.rl"
+#line 94 "ebb_request_parser.rl"
 	{ parser->fragment_start      = p - buf; }
 	goto st91;
 st91:
 	if ( ++p == pe )
 		goto _test_eof91;
 case 91:
-#line 2463 "ebb_request_parser.c"
+#line 2791 "ebb_request_parser.c"
 	if ( (*p) < 65 ) {
 		if ( 48 <= (*p) && (*p) <= 57 )
 			goto st92;
@@ -2483,14 +2811,14 @@ case 92:
 		goto st90;
 	goto st0;
 tr6:
-#line 92 "ebb_request_parser.rl"
+#line 103 "ebb_request_parser.rl"
 	{ parser->uri_start           = p - buf; }
 	goto st93;
 st93:
 	if ( ++p == pe )
 		goto _test_eof93;
 case 93:
-#line 2494 "ebb_request_parser.c"
+#line 2822 "ebb_request_parser.c"
 	switch( (*p) ) {
 		case 43: goto st93;
 		case 58: goto st94;
@@ -2508,14 +2836,14 @@ case 93:
 		goto st93;
 	goto st0;
 tr8:
-#line 92 "ebb_request_parser.rl"
+#line 103 "ebb_request_parser.rl"
 	{ parser->uri_start           = p - buf; }
 	goto st94;
 st94:
 	if ( ++p == pe )
 		goto _test_eof94;
 case 94:
-#line 2519 "ebb_request_parser.c"
+#line 2847 "ebb_request_parser.c"
 	switch( (*p) ) {
 		case 32: goto tr9;
 		case 34: goto st0;
@@ -2555,16 +2883,16 @@ case 96:
 		goto st94;
 	goto st0;
 tr7:
-#line 92 "ebb_request_parser.rl"
+#line 103 "ebb_request_parser.rl"
 	{ parser->uri_start           = p - buf; }
-#line 89 "ebb_request_parser.rl"
+#line 100 "ebb_request_parser.rl"
 	{ parser->path_start          = p - buf; }
 	goto st97;
 st97:
 	if ( ++p == pe )
 		goto _test_eof97;
 case 97:
-#line 2568 "ebb_request_parser.c"
+#line 2896 "ebb_request_parser.c"
 	switch( (*p) ) {
 		case 32: goto tr120;
 		case 34: goto st0;
@@ -2605,14 +2933,14 @@ case 99:
 		goto st97;
 	goto st0;
 tr123:
-#line 90 "ebb_request_parser.rl"
+#line 101 "ebb_request_parser.rl"
 	{ parser->path_end            = p - buf; }
 	goto st100;
 st100:
 	if ( ++p == pe )
 		goto _test_eof100;
 case 100:
-#line 2616 "ebb_request_parser.c"
+#line 2944 "ebb_request_parser.c"
 	switch( (*p) ) {
 		case 32: goto tr126;
 		case 34: goto st0;
@@ -2626,14 +2954,14 @@ case 100:
 		goto st0;
 	goto tr125;
 tr125:
-#line 86 "ebb_request_parser.rl"
+#line 97 "ebb_request_parser.rl"
 	{ parser->query_string_start  = p - buf; }
 	goto st101;
 st101:
 	if ( ++p == pe )
 		goto _test_eof101;
 case 101:
-#line 2637 "ebb_request_parser.c"
+#line 2965 "ebb_request_parser.c"
 	switch( (*p) ) {
 		case 32: goto tr130;
 		case 34: goto st0;
@@ -2647,14 +2975,14 @@ case 101:
 		goto st0;
 	goto st101;
 tr128:
-#line 86 "ebb_request_parser.rl"
+#line 97 "ebb_request_parser.rl"
 	{ parser->query_string_start  = p - buf; }
 	goto st102;
 st102:
 	if ( ++p == pe )
 		goto _test_eof102;
 case 102:
-#line 2658 "ebb_request_parser.c"
+#line 2986 "ebb_request_parser.c"
 	if ( (*p) < 65 ) {
 		if ( 48 <= (*p) && (*p) <= 57 )
 			goto st103;
@@ -2678,17 +3006,19 @@ case 103:
 		goto st101;
 	goto st0;
 tr219:
-#line 189 "ebb_request_parser.rl"
+#line 201 "ebb_request_parser.rl"
 	{
     assert(CURRENT == NULL);
     CURRENT = parser->new_request(parser->data);
+    parser->request_start = p - buf;
+    parser->headers_end = -1;
   }
 	goto st104;
 st104:
 	if ( ++p == pe )
 		goto _test_eof104;
 case 104:
-#line 2692 "ebb_request_parser.c"
+#line 3022 "ebb_request_parser.c"
 	if ( (*p) == 69 )
 		goto st105;
 	goto st0;
@@ -2728,17 +3058,19 @@ case 109:
 		goto tr139;
 	goto st0;
 tr220:
-#line 189 "ebb_request_parser.rl"
+#line 201 "ebb_request_parser.rl"
 	{
     assert(CURRENT == NULL);
     CURRENT = parser->new_request(parser->data);
+    parser->request_start = p - buf;
+    parser->headers_end = -1;
   }
 	goto st110;
 st110:
 	if ( ++p == pe )
 		goto _test_eof110;
 case 110:
-#line 2742 "ebb_request_parser.c"
+#line 3074 "ebb_request_parser.c"
 	if ( (*p) == 69 )
 		goto st111;
 	goto st0;
@@ -2757,17 +3089,19 @@ case 112:
 		goto tr142;
 	goto st0;
 tr221:
-#line 189 "ebb_request_parser.rl"
+#line 201 "ebb_request_parser.rl"
 	{
     assert(CURRENT == NULL);
     CURRENT = parser->new_request(parser->data);
+    parser->request_start = p - buf;
+    parser->headers_end = -1;
   }
 	goto st113;
 st113:
 	if ( ++p == pe )
 		goto _test_eof113;
 case 113:
-#line 2771 "ebb_request_parser.c"
+#line 3105 "ebb_request_parser.c"
 	if ( (*p) == 69 )
 		goto st114;
 	goto st0;
@@ -2793,17 +3127,19 @@ case 116:
 		goto tr146;
 	goto st0;
 tr222:
-#line 189 "ebb_request_parser.rl"
+#line 201 "ebb_request_parser.rl"
 	{
     assert(CURRENT == NULL);
     CURRENT = parser->new_request(parser->data);
+    parser->request_start = p - buf;
+    parser->headers_end = -1;
   }
 	goto st117;
 st117:
 	if ( ++p == pe )
 		goto _test_eof117;
 case 117:
-#line 2807 "ebb_request_parser.c"
+#line 3143 "ebb_request_parser.c"
 	if ( (*p) == 79 )
 		goto st118;
 	goto st0;
@@ -2829,17 +3165,19 @@ case 120:
 		goto tr150;
 	goto st0;
 tr223:
-#line 189 "ebb_request_parser.rl"
+#line 201 "ebb_request_parser.rl"
 	{
     assert(CURRENT == NULL);
     CURRENT = parser->new_request(parser->data);
+    parser->request_start = p - buf;
+    parser->headers_end = -1;
   }
 	goto st121;
 st121:
 	if ( ++p == pe )
 		goto _test_eof121;
 case 121:
-#line 2843 "ebb_request_parser.c"
+#line 3181 "ebb_request_parser.c"
 	switch( (*p) ) {
 		case 75: goto st122;
 		case 79: goto st126;
@@ -2895,17 +3233,19 @@ case 128:
 		goto tr159;
 	goto st0;
 tr224:
-#line 189 "ebb_request_parser.rl"
+#line 201 "ebb_request_parser.rl"
 	{
     assert(CURRENT == NULL);
     CURRENT = parser->new_request(parser->data);
+    parser->request_start = p - buf;
+    parser->headers_end = -1;
   }
 	goto st129;
 st129:
 	if ( ++p == pe )
 		goto _test_eof129;
 case 129:
-#line 2909 "ebb_request_parser.c"
+#line 3249 "ebb_request_parser.c"
 	if ( (*p) == 80 )
 		goto st130;
 	goto st0;
@@ -2952,17 +3292,19 @@ case 135:
 		goto tr166;
 	goto st0;
 tr225:
-#line 189 "ebb_request_parser.rl"
+#line 201 "ebb_request_parser.rl"
 	{
     assert(CURRENT == NULL);
     CURRENT = parser->new_request(parser->data);
+    parser->request_start = p - buf;
+    parser->headers_end = -1;
   }
 	goto st136;
 st136:
 	if ( ++p == pe )
 		goto _test_eof136;
 case 136:
-#line 2966 "ebb_request_parser.c"
+#line 3308 "ebb_request_parser.c"
 	switch( (*p) ) {
 		case 79: goto st137;
 		case 82: goto st140;
@@ -3091,17 +3433,19 @@ case 153:
 		goto tr187;
 	goto st0;
 tr226:
-#line 189 "ebb_request_parser.rl"
+#line 201 "ebb_request_parser.rl"
 	{
     assert(CURRENT == NULL);
     CURRENT = parser->new_request(parser->data);
+    parser->request_start = p - buf;
+    parser->headers_end = -1;
   }
 	goto st154;
 st154:
 	if ( ++p == pe )
 		goto _test_eof154;
 case 154:
-#line 3105 "ebb_request_parser.c"
+#line 3449 "ebb_request_parser.c"
 	if ( (*p) == 82 )
 		goto st155;
 	goto st0;
@@ -3134,17 +3478,19 @@ case 158:
 		goto tr192;
 	goto st0;
 tr227:
-#line 189 "ebb_request_parser.rl"
+#line 201 "ebb_request_parser.rl"
 	{
     assert(CURRENT == NULL);
     CURRENT = parser->new_request(parser->data);
+    parser->request_start = p - buf;
+    parser->headers_end = -1;
   }
 	goto st159;
 st159:
 	if ( ++p == pe )
 		goto _test_eof159;
 case 159:
-#line 3148 "ebb_request_parser.c"
+#line 3494 "ebb_request_parser.c"
 	if ( (*p) == 78 )
 		goto st160;
 	goto st0;
@@ -3199,7 +3545,7 @@ case 165:
 		goto tr200;
 	goto st0;
 tr199:
-#line 169 "ebb_request_parser.rl"
+#line 181 "ebb_request_parser.rl"
 	{
     parser->chunk_size *= 16;
     parser->chunk_size += unhex[(int)*p];
@@ -3209,7 +3555,7 @@ st166:
 	if ( ++p == pe )
 		goto _test_eof166;
 case 166:
-#line 3213 "ebb_request_parser.c"
+#line 3559 "ebb_request_parser.c"
 	switch( (*p) ) {
 		case 13: goto st167;
 		case 48: goto tr199;
@@ -3268,7 +3614,7 @@ case 169:
 	goto st0;
 tr206:
 	cs = 184;
-#line 184 "ebb_request_parser.rl"
+#line 196 "ebb_request_parser.rl"
 	{
     END_REQUEST;
     cs = 183;
@@ -3278,7 +3624,7 @@ st184:
 	if ( ++p == pe )
 		goto _test_eof184;
 case 184:
-#line 3282 "ebb_request_parser.c"
+#line 3628 "ebb_request_parser.c"
 	goto st0;
 st170:
 	if ( ++p == pe )
@@ -3316,7 +3662,7 @@ case 171:
 		goto st167;
 	goto st171;
 tr200:
-#line 169 "ebb_request_parser.rl"
+#line 181 "ebb_request_parser.rl"
 	{
     parser->chunk_size *= 16;
     parser->chunk_size += unhex[(int)*p];
@@ -3326,7 +3672,7 @@ st172:
 	if ( ++p == pe )
 		goto _test_eof172;
 case 172:
-#line 3330 "ebb_request_parser.c"
+#line 3676 "ebb_request_parser.c"
 	switch( (*p) ) {
 		case 13: goto st173;
 		case 59: goto st177;
@@ -3353,7 +3699,7 @@ st174:
 case 174:
 	goto tr211;
 tr211:
-#line 174 "ebb_request_parser.rl"
+#line 186 "ebb_request_parser.rl"
 	{
     skip_body(&p, parser, MIN(parser->chunk_size, REMAINING));
     p--; 
@@ -3368,7 +3714,7 @@ st175:
 	if ( ++p == pe )
 		goto _test_eof175;
 case 175:
-#line 3372 "ebb_request_parser.c"
+#line 3718 "ebb_request_parser.c"
 	if ( (*p) == 13 )
 		goto st176;
 	goto st0;
@@ -3749,16 +4095,16 @@ case 182:
 	_out: {}
 	}
 
-#line 374 "ebb_request_parser.rl"
+#line 702 "ebb_request_parser.rl"
 
   parser->cs = cs;
 
-  HEADER_CALLBACK(header_field);
-  HEADER_CALLBACK(header_value);
-  CALLBACK(fragment);
-  CALLBACK(query_string);
-  CALLBACK(path);
-  CALLBACK(uri);
+  FLUSH(HEADER_CALLBACK, header_field);
+  FLUSH(HEADER_CALLBACK, header_value);
+  FLUSH(CALLBACK, fragment);
+  FLUSH(CALLBACK, query_string);
+  FLUSH(CALLBACK, path);
+  FLUSH(CALLBACK, uri);
 
   assert(p <= pe && "buffer overflow after parsing execute");
 
@@ -3775,6 +4121,62 @@ int ebb_request_parser_is_finished(ebb_request_parser *parser)
   return parser->cs == ebb_request_parser_first_final;
 }
 
+size_t ebb_request_parser_relocate(ebb_request_parser *parser, const char *buffer, size_t len, char *new_buffer)
+{
+  ebb_request *request = CURRENT;
+  size_t start, end;
+  int i, n;
+
+  if(request == NULL || parser->request_start < 0) return 0;
+
+  start = parser->request_start;
+  /* once the headers are complete only the body is being read, and that
+   * has been handed to on_body already */
+  end = parser->headers_end >= 0 ? (size_t)parser->headers_end : len;
+  assert(start <= end && end <= len);
+
+  memmove(new_buffer, buffer + start, end - start);
+
+#define MOVE_OFFSET(X) if(parser->X >= 0) parser->X -= start
+#define MOVE_POINTER(P) P = new_buffer + ((P) - (buffer + start))
+  MOVE_OFFSET(request_start);
+  MOVE_OFFSET(headers_end);
+  MOVE_OFFSET(stored_field_start);
+  MOVE_OFFSET(stored_field_end);
+  MOVE_OFFSET(header_field_start);
+  MOVE_OFFSET(header_field_end);
+  MOVE_OFFSET(header_value_start);
+  MOVE_OFFSET(header_value_end);
+  MOVE_OFFSET(query_string_start);
+  MOVE_OFFSET(query_string_end);
+  MOVE_OFFSET(path_start);
+  MOVE_OFFSET(path_end);
+  MOVE_OFFSET(uri_start);
+  MOVE_OFFSET(uri_end);
+  MOVE_OFFSET(fragment_start);
+  MOVE_OFFSET(fragment_end);
+
+  if(request->store_headers) {
+    n = MIN(request->number_of_headers, EBB_MAX_HEADERS);
+    /* between the CR and LF of a header line its entry is stored but
+     * not yet counted. its slot gives it away. */
+    if(n < EBB_MAX_HEADERS && memchr(request->header_slots, n + 1, EBB_HEADER_SLOTS))
+      n++;
+    for(i = 0; i < n; i++) {
+      MOVE_POINTER(request->headers[i].field);
+      MOVE_POINTER(request->headers[i].value);
+    }
+  }
+  for(i = 0; i < EBB_NUMBER_OF_KNOWN_HEADERS; i++) {
+    if(request->known_headers[i])
+      MOVE_POINTER(request->known_headers[i]);
+  }
+#undef MOVE_OFFSET
+#undef MOVE_POINTER
+
+  return end - start;
+}
+
 void ebb_request_init(ebb_request *request)
 {
   request->expect_continue = FALSE;
@@ -3783,8 +4185,15 @@ void ebb_request_init(ebb_request *request)
   request->version_major = 0;
   request->version_minor = 0;
   request->number_of_headers = 0;
+  request->store_headers = FALSE;
+  memset(request->header_slots, 0, sizeof request->header_slots);
+  memset(request->known_headers, 0, sizeof request->known_headers);
+  request->accept_encoding = 0;
+  request->if_modified_since = -1;
+  request->range_start = request->range_end = -1;
   request->transfer_encoding = EBB_IDENTITY;
   request->keep_alive = -1;
+  request->connection = NULL;
 
   request->on_complete = NULL;
   request->on_headers_complete = NULL;
@@ -3809,3 +4218,21 @@ int ebb_request_should_keep_alive(ebb_request *request)
   else
     return request->keep_alive;
 }
+
+/**
+ * Looks up a header stored by the parser. Names are compared case
+ * insensitively. Only works if request->store_headers was set before
+ * the headers were parsed. Returns the first header with that name or
+ * NULL.
+ */
+ebb_header* ebb_request_find_header(ebb_request *request, const char *field, size_t length)
+{
+  unsigned int slot = header_hash(field, length) % EBB_HEADER_SLOTS;
+  while(request->header_slots[slot] != 0) {
+    ebb_header *header = &request->headers[request->header_slots[slot] - 1];
+    if(header->field_length == length && 0 == strncasecmp(header->field, field, length))
+      return header;
+    slot = (slot + 1) % EBB_HEADER_SLOTS;
+  }
+  return NULL;
+}
@@ -33,14 +33,23 @@ extern "C" {
 
 
 #include <sys/types.h> 
+#include <time.h>
 
 typedef struct ebb_request ebb_request;
 typedef struct ebb_request_parser  ebb_request_parser;
+typedef struct ebb_header ebb_header;
 typedef void (*ebb_header_cb)(ebb_request*, const char *at, size_t length, int header_index);
 typedef void (*ebb_element_cb)(ebb_request*, const char *at, size_t length);
 
 #define EBB_MAX_MULTIPART_BOUNDARY_LEN 20
 
+/* Capacity of ebb_request.headers (at most 255). Headers past this are
+ * still counted in number_of_headers and reported through the callbacks. */
+#ifndef EBB_MAX_HEADERS
+# define EBB_MAX_HEADERS 32
+#endif
+#define EBB_HEADER_SLOTS (2 * EBB_MAX_HEADERS)
+
 /* HTTP Methods */
 #define EBB_COPY       0x00000001
 #define EBB_DELETE     0x00000002
@@ -61,6 +70,38 @@ typedef void (*ebb_element_cb)(ebb_request*, const char *at, size_t length);
 #define EBB_IDENTITY   0x00000001
 #define EBB_CHUNKED    0x00000002
 
+/* Well known headers. The parser recognizes these by name and records
+ * their values in ebb_request.known_headers. */
+#define EBB_HEADER_OTHER               0
+#define EBB_HEADER_CONTENT_LENGTH      1
+#define EBB_HEADER_CONNECTION          2
+#define EBB_HEADER_TRANSFER_ENCODING   3
+#define EBB_HEADER_HOST                4
+#define EBB_HEADER_CONTENT_TYPE        5
+#define EBB_HEADER_ACCEPT_ENCODING     6
+#define EBB_HEADER_IF_NONE_MATCH       7
+#define EBB_HEADER_IF_MODIFIED_SINCE   8
+#define EBB_HEADER_COOKIE              9
+#define EBB_HEADER_UPGRADE            10
+#define EBB_HEADER_RANGE              11
+#define EBB_NUMBER_OF_KNOWN_HEADERS   12
+
+/* Accept-Encoding */
+#define EBB_ACCEPT_GZIP      0x00000001
+#define EBB_ACCEPT_DEFLATE   0x00000002
+#define EBB_ACCEPT_BR        0x00000004
+#define EBB_ACCEPT_ANY       0x00000008
+
+/* Slices into the buffer given to ebb_request_parser_execute(). They are
+ * not null terminated. */
+struct ebb_header {
+  const char *field;
+  size_t field_length;
+  const char *value;
+  size_t value_length;
+  int id;                 /* EBB_HEADER_* */
+};
+
 struct ebb_request {
   int method;
   int transfer_encoding;         /* ro */
@@ -72,6 +113,36 @@ struct ebb_request {
   size_t content_length;             /* ro - 0 if unknown */
   size_t body_read;                  /* ro */
 
+  /* Public - set to TRUE in new_request to have the parser fill headers[].
+   * This happens independently of on_header_field/on_header_value.
+   * headers[] and known_headers[] point into the buffer being parsed and
+   * are only valid until on_complete returns; libebb reuses or frees its
+   * read buffer after that. Copy what is needed later, for example with
+   * ebb_request_strndup. */
+  unsigned store_headers:1;
+  ebb_header headers[EBB_MAX_HEADERS];            /* ro */
+  unsigned char header_slots[EBB_HEADER_SLOTS];   /* private */
+
+  /* ro - values of the well known headers, indexed by EBB_HEADER_*. NULL
+   * if the header was not sent. Like headers[] these point into the
+   * parsed buffer, valid until on_complete returns. If a header is
+   * repeated the first one is kept. */
+  const char *known_headers[EBB_NUMBER_OF_KNOWN_HEADERS];
+  size_t known_header_lengths[EBB_NUMBER_OF_KNOWN_HEADERS];
+
+  int accept_encoding;               /* ro - EBB_ACCEPT_* flags */
+  time_t if_modified_since;          /* ro - -1 if not sent or not an RFC 1123 date */
+
+  /* ro - first range of "Range: bytes=a-b", inclusive. A missing number
+   * is -1, so "bytes=-500" (the last 500 bytes) gives -1 and 500. Both
+   * are -1 if there is no usable Range header. */
+  off_t range_start;
+  off_t range_end;
+
+  /* ro - the ebb_connection the request came in on, set by libebb after
+   * new_request. NULL when the parser is used on its own. */
+  void *connection;
+
   /* Public  - ordered list of callbacks */
   ebb_element_cb on_path;
   ebb_element_cb on_query_string;
@@ -89,6 +160,11 @@ struct ebb_request_parser {
   int cs;                           /* private */
   size_t chunk_size;                /* private */
   unsigned eating:1;                /* private */
+  int header_id;                    /* private */
+  int request_start;                /* private */
+  int headers_end;                  /* private */
+  int stored_field_start;           /* private */
+  int stored_field_end;             /* private */
   ebb_request *current_request;     /* ro */
   int header_field_start;
   int header_field_end;
@@ -112,8 +188,18 @@ void ebb_request_parser_init(ebb_request_parser *parser);
 size_t ebb_request_parser_execute(ebb_request_parser *parser, const char *data, size_t len, size_t off);
 int ebb_request_parser_has_error(ebb_request_parser *parser);
 int ebb_request_parser_is_finished(ebb_request_parser *parser);
+/* Moves the bytes the parser still refers to (the current request up to
+ * the end of its headers) from buffer to the front of new_buffer, which
+ * may be buffer itself, and adjusts the parser's offsets and the pointers
+ * in the current request. Call only after execute() has consumed all len
+ * bytes of buffer. Returns the number of bytes kept; parsing continues at
+ * that offset in new_buffer. Pointers the user copied out of the request
+ * are not updated.
+ */
+size_t ebb_request_parser_relocate(ebb_request_parser *parser, const char *buffer, size_t len, char *new_buffer);
 void ebb_request_init(ebb_request *);
 int ebb_request_should_keep_alive(ebb_request *request);
+ebb_header* ebb_request_find_header(ebb_request *request, const char *field, size_t length);
 #define ebb_request_has_body(request) \
   (request->transfer_encoding == EBB_CHUNKED || request->content_length > 0 )
 
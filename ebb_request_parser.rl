@@ -28,6 +28,9 @@
 #include "ebb_request_parser.h"
 
 #include <stdio.h>
+#include <string.h>
+#include <strings.h> /* strncasecmp */
+#include <stdint.h>
 #include <assert.h>
 
 static int unhex[] = {-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1
@@ -65,6 +68,14 @@ static int unhex[] = {-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1
                 , CURRENT->number_of_headers        \
                 );                                  \
  }
+/* Elements which are complete but whose action has not fired yet are
+ * handed out at the end of ebb_request_parser_execute(). Reset them so the
+ * pending action doesn't report them a second time. */
+#define FLUSH(CB, FOR)                              \
+  if(parser->FOR##_end >= 0) {                      \
+    CB(FOR);                                        \
+    parser->FOR##_start = parser->FOR##_end = -1;   \
+  }
 #define END_REQUEST                        \
     if(CURRENT && CURRENT->on_complete)               \
       CURRENT->on_complete(CURRENT);       \
@@ -75,10 +86,10 @@ static int unhex[] = {-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1
   machine ebb_request_parser;
 
   action start_header_field   { parser->header_field_start  = p - buf; }
-  action end_header_field     { parser->header_field_end    = p - buf; }
+  action end_header_field     { parser->header_field_end    = p - buf; store_header_field(parser, buf); }
 
-  action start_header_value   { parser->header_value_start  = p - buf; }
-  action end_header_value     { parser->header_value_end    = p - buf; }
+  action start_header_value   { parser->header_value_start  = p - buf; if(*p != '\r') p = skip_value(parser, p + 1, pe) - 1; }
+  action end_header_value     { parser->header_value_end    = p - buf; store_header_value(parser, buf); }
 
   action start_fragment       { parser->fragment_start      = p - buf; }
   action end_fragment         { parser->fragment_end        = p - buf; }
@@ -94,27 +105,27 @@ static int unhex[] = {-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1
 
   action write_field { 
     HEADER_CALLBACK(header_field);
-    parser->header_field_start = -1;
+    parser->header_field_start = parser->header_field_end = -1;
   }
 
   action write_value {
     HEADER_CALLBACK(header_value);
-    parser->header_value_start = -1;
+    parser->header_value_start = parser->header_value_end = -1;
   }
 
   action request_uri { 
     CALLBACK(uri);
-    parser->uri_start = -1;
+    parser->uri_start = parser->uri_end = -1;
   }
 
   action fragment { 
     CALLBACK(fragment);
-    parser->fragment_start = -1;
+    parser->fragment_start = parser->fragment_end = -1;
   }
 
   action query_string { 
     CALLBACK(query_string);
-    parser->query_string_start = -1;
+    parser->query_string_start = parser->query_string_end = -1;
   }
 
   action request_path {
@@ -162,6 +173,7 @@ static int unhex[] = {-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1
   }
 
   action end_headers {
+    parser->headers_end = p - buf + 1;
     if(CURRENT && CURRENT->on_headers_complete)
       CURRENT->on_headers_complete(CURRENT);
   }
@@ -189,6 +201,8 @@ static int unhex[] = {-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1
   action start_req {
     assert(CURRENT == NULL);
     CURRENT = parser->new_request(parser->data);
+    parser->request_start = p - buf;
+    parser->headers_end = -1;
   }
 
   action body_logic {
@@ -329,6 +343,313 @@ skip_body(const char **p, ebb_request_parser *parser, size_t nskip) {
   }
 }
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__)
+# define SIMD_SCAN 1
+# include <immintrin.h>
+
+static const char*
+find_cr_sse2(const char *p, const char *pe)
+{
+  const __m128i cr = _mm_set1_epi8('\r');
+  for(; pe - p >= 16; p += 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i*)p);
+    int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, cr));
+    if(mask) return p + __builtin_ctz(mask);
+  }
+  while(p < pe && *p != '\r') p++;
+  return p;
+}
+
+__attribute__((target("avx2")))
+static const char*
+find_cr_avx2(const char *p, const char *pe)
+{
+  const __m256i cr = _mm256_set1_epi8('\r');
+  for(; pe - p >= 32; p += 32) {
+    __m256i chunk = _mm256_loadu_si256((const __m256i*)p);
+    unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, cr));
+    if(mask) return p + __builtin_ctz(mask);
+  }
+  return find_cr_sse2(p, pe);
+}
+
+static const char* (*find_cr_simd)(const char *p, const char *pe) = find_cr_sse2;
+
+/* picks find_cr_simd once, when the library is loaded, rather than
+ * asking the CPU on every header value */
+__attribute__((constructor))
+static void
+pick_find_cr(void)
+{
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx2"))
+    find_cr_simd = find_cr_avx2;
+}
+#endif
+
+/* Returns the first CR in [p, pe) or pe. */
+static const char*
+find_cr(const char *p, const char *pe)
+{
+#ifdef SIMD_SCAN
+  return find_cr_simd(p, pe);
+#else
+  const char *cr = memchr(p, '\r', pe - p);
+  return cr ? cr : pe;
+#endif
+}
+
+/* Header values (long cookies, mostly) run up to the CR without any
+ * state change, so the machine is moved there at once instead of taking
+ * one transition per byte. Content-Length, Connection and
+ * Transfer-Encoding are matched by the machine itself while in their
+ * values and are not skipped. Returns where parsing goes on: the CR, pe,
+ * or p for those three.
+ */
+static const char*
+skip_value(ebb_request_parser *parser, const char *p, const char *pe)
+{
+  if(parser->header_id == EBB_HEADER_CONTENT_LENGTH ||
+     parser->header_id == EBB_HEADER_CONNECTION ||
+     parser->header_id == EBB_HEADER_TRANSFER_ENCODING)
+    return p;
+  return find_cr(p, pe);
+}
+
+static unsigned int
+header_hash(const char *field, size_t length)
+{
+  unsigned int h = 0;
+  size_t i;
+  for(i = 0; i < length; i++)
+    h = h * 31 + (field[i] | 0x20); /* ascii lower case */
+  return h;
+}
+
+#define HEADER_IS(NAME, ID) \
+  return 0 == strncasecmp(NAME, field, length) ? ID : EBB_HEADER_OTHER
+
+/* Length and first character rule out nearly every unknown header
+ * before a string comparison is made. */
+static int
+header_id(const char *field, size_t length)
+{
+  char c = field[0] | 0x20; /* ascii lower case */
+
+  switch(length) {
+    case 4:  if(c == 'h') HEADER_IS("host",              EBB_HEADER_HOST);              break;
+    case 5:  if(c == 'r') HEADER_IS("range",             EBB_HEADER_RANGE);             break;
+    case 6:  if(c == 'c') HEADER_IS("cookie",            EBB_HEADER_COOKIE);            break;
+    case 7:  if(c == 'u') HEADER_IS("upgrade",           EBB_HEADER_UPGRADE);           break;
+    case 10: if(c == 'c') HEADER_IS("connection",        EBB_HEADER_CONNECTION);        break;
+    case 12: if(c == 'c') HEADER_IS("content-type",      EBB_HEADER_CONTENT_TYPE);      break;
+    case 13: if(c == 'i') HEADER_IS("if-none-match",     EBB_HEADER_IF_NONE_MATCH);     break;
+    case 14: if(c == 'c') HEADER_IS("content-length",    EBB_HEADER_CONTENT_LENGTH);    break;
+    case 15: if(c == 'a') HEADER_IS("accept-encoding",   EBB_HEADER_ACCEPT_ENCODING);   break;
+    case 17: if(c == 't') HEADER_IS("transfer-encoding", EBB_HEADER_TRANSFER_ENCODING);
+             if(c == 'i') HEADER_IS("if-modified-since", EBB_HEADER_IF_MODIFIED_SINCE);
+             break;
+  }
+  return EBB_HEADER_OTHER;
+}
+
+/* "gzip, deflate;q=0.5, br;q=0" */
+static int
+parse_accept_encoding(const char *at, size_t length)
+{
+  const char *end = at + length;
+  const char *token, *token_end;
+  int encodings = 0;
+  int rejected;
+
+  while(at < end) {
+    while(at < end && (*at == ' ' || *at == '\t' || *at == ',')) at++;
+    token = at;
+    while(at < end && *at != ' ' && *at != '\t' && *at != ',' && *at != ';') at++;
+    token_end = at;
+
+    /* parameters. only q=0 matters. */
+    rejected = FALSE;
+    for(; at < end && *at != ','; at++) {
+      if((*at | 0x20) == 'q' && at + 2 < end && at[1] == '=' && at[2] == '0') {
+        const char *q;
+        rejected = TRUE;
+        for(q = at + 3; q < end && *q != ',' && *q != ';' && *q != ' '; q++)
+          if(*q != '.' && *q != '0') rejected = FALSE;
+      }
+    }
+    if(rejected) continue;
+
+#define TOKEN_IS(S) (token_end - token == sizeof(S) - 1 && 0 == strncasecmp(S, token, sizeof(S) - 1))
+    if(TOKEN_IS("gzip") || TOKEN_IS("x-gzip"))
+      encodings |= EBB_ACCEPT_GZIP;
+    else if(TOKEN_IS("deflate"))
+      encodings |= EBB_ACCEPT_DEFLATE;
+    else if(TOKEN_IS("br"))
+      encodings |= EBB_ACCEPT_BR;
+    else if(TOKEN_IS("*"))
+      encodings |= EBB_ACCEPT_ANY;
+#undef TOKEN_IS
+  }
+  return encodings;
+}
+
+/* days since 1970-01-01 in the proleptic gregorian calendar */
+static long
+days_from_civil(long y, int m, int d)
+{
+  long era, yoe, doy, doe;
+  y -= m <= 2;
+  era = (y >= 0 ? y : y - 399) / 400;
+  yoe = y - era * 400;
+  doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+  doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  return era * 146097 + doe - 719468;
+}
+
+static int
+days_in_month(int year, int month)
+{
+  static const int days[] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+  if(month == 1 && year % 4 == 0 && (year % 100 != 0 || year % 400 == 0))
+    return 29;
+  return days[month];
+}
+
+static int
+two_digits(const char *at)
+{
+  if(at[0] < '0' || at[0] > '9' || at[1] < '0' || at[1] > '9') return -1;
+  return (at[0] - '0') * 10 + (at[1] - '0');
+}
+
+/* "Sun, 06 Nov 1994 08:49:37 GMT" - RFC 1123, the only format servers
+ * are required to send. The obsolete formats give -1. */
+static time_t
+parse_http_date(const char *at, size_t length)
+{
+  static const char months[] = "janfebmaraprmayjunjulaugsepoctnovdec";
+  int day, month, century, year, hour, minute, second;
+
+  if(length != 29 || at[3] != ',' || at[4] != ' ' || at[7] != ' ' ||
+      at[11] != ' ' || at[16] != ' ' || at[19] != ':' || at[22] != ':' ||
+      0 != strncmp(at + 25, " GMT", 4))
+    return -1;
+
+  for(month = 0; month < 12; month++) {
+    if(months[3*month] == (at[8] | 0x20) &&
+        months[3*month + 1] == (at[9] | 0x20) &&
+        months[3*month + 2] == (at[10] | 0x20))
+      break;
+  }
+  day = two_digits(at + 5);
+  century = two_digits(at + 12);
+  year = two_digits(at + 14);
+  hour = two_digits(at + 17);
+  minute = two_digits(at + 20);
+  second = two_digits(at + 23);
+  if(month == 12 || century < 0 || year < 0 || day < 1 ||
+      day > days_in_month(century * 100 + year, month) ||
+      hour < 0 || hour > 23 || minute < 0 || minute > 59 ||
+      second < 0 || second > 60)
+    return -1;
+
+  return (time_t)days_from_civil(century * 100 + year, month + 1, day) * 86400
+       + hour * 3600 + minute * 60 + second;
+}
+
+#define OFF_T_MAX ((off_t)(((uint64_t)1 << (sizeof(off_t) * 8 - 1)) - 1))
+
+/* "bytes=0-499", "bytes=500-", "bytes=-500". Only the first range of a
+ * list is looked at. Numbers too large for off_t make it invalid. */
+static void
+parse_range(ebb_request *request, const char *at, size_t length)
+{
+  const char *end = at + length;
+  off_t start = -1, stop = -1;
+
+  if(length < 7 || 0 != strncasecmp("bytes=", at, 6))
+    return;
+  for(at += 6; at < end && *at >= '0' && *at <= '9'; at++) {
+    if(start > (OFF_T_MAX - 9) / 10) return;
+    start = (start < 0 ? 0 : start * 10) + (*at - '0');
+  }
+  if(at == end || *at != '-')
+    return;
+  for(at++; at < end && *at >= '0' && *at <= '9'; at++) {
+    if(stop > (OFF_T_MAX - 9) / 10) return;
+    stop = (stop < 0 ? 0 : stop * 10) + (*at - '0');
+  }
+  if(at != end && *at != ',' && *at != ' ')
+    return;
+  if(start < 0 && stop < 0)
+    return;
+  if(start >= 0 && stop >= 0 && stop < start)
+    return;
+
+  request->range_start = start;
+  request->range_end = stop;
+}
+
+static void
+store_header_field(ebb_request_parser *parser, const char *buf)
+{
+  ebb_request *request = CURRENT;
+  const char *field = buf + parser->header_field_start;
+  size_t length = parser->header_field_end - parser->header_field_start;
+
+  if(request == NULL) return;
+
+  parser->header_id = header_id(field, length);
+  /* remembered as offsets so that ebb_request_parser_relocate() can
+   * move them. headers[] gets the field with its value. */
+  parser->stored_field_start = parser->header_field_start;
+  parser->stored_field_end = parser->header_field_end;
+}
+
+static void
+store_header_value(ebb_request_parser *parser, const char *buf)
+{
+  ebb_request *request = CURRENT;
+  const char *value = buf + parser->header_value_start;
+  size_t length = parser->header_value_end - parser->header_value_start;
+  int id = parser->header_id;
+
+  if(request == NULL) return;
+
+  if(id != EBB_HEADER_OTHER && request->known_headers[id] == NULL) {
+    request->known_headers[id] = value;
+    request->known_header_lengths[id] = length;
+
+    switch(id) {
+      case EBB_HEADER_ACCEPT_ENCODING:
+        request->accept_encoding = parse_accept_encoding(value, length);
+        break;
+      case EBB_HEADER_IF_MODIFIED_SINCE:
+        request->if_modified_since = parse_http_date(value, length);
+        break;
+      case EBB_HEADER_RANGE:
+        parse_range(request, value, length);
+        break;
+    }
+  }
+
+  if(request->store_headers && request->number_of_headers < EBB_MAX_HEADERS) {
+    ebb_header *header = &request->headers[request->number_of_headers];
+    header->field = buf + parser->stored_field_start;
+    header->field_length = parser->stored_field_end - parser->stored_field_start;
+    header->value = value;
+    header->value_length = length;
+    header->id = id;
+
+    /* open addressing, the first header with a given name wins */
+    unsigned int slot = header_hash(header->field, header->field_length) % EBB_HEADER_SLOTS;
+    while(request->header_slots[slot] != 0)
+      slot = (slot + 1) % EBB_HEADER_SLOTS;
+    request->header_slots[slot] = request->number_of_headers + 1;
+  }
+}
+
 void ebb_request_parser_init(ebb_request_parser *parser) 
 {
   int cs = 0;
@@ -339,6 +660,9 @@ void ebb_request_parser_init(ebb_request_parser *parser)
   parser->eating = 0;
   
   parser->current_request = NULL;
+  parser->header_id = EBB_HEADER_OTHER;
+  parser->request_start = parser->headers_end = -1;
+  parser->stored_field_start = parser->stored_field_end = -1;
 
   parser->header_field_start = parser->header_field_end = -1;
   parser->header_value_start = parser->header_value_end = -1;
@@ -370,16 +694,20 @@ size_t ebb_request_parser_execute(ebb_request_parser *parser, const char *buffer
     skip_body(&p, parser, eat);
   } 
 
+  /* the last buffer ended inside a header value */
+  if(parser->header_value_start >= 0 && parser->header_value_end < 0)
+    p = skip_value(parser, p, pe);
+
   %% write exec;
 
   parser->cs = cs;
 
-  HEADER_CALLBACK(header_field);
-  HEADER_CALLBACK(header_value);
-  CALLBACK(fragment);
-  CALLBACK(query_string);
-  CALLBACK(path);
-  CALLBACK(uri);
+  FLUSH(HEADER_CALLBACK, header_field);
+  FLUSH(HEADER_CALLBACK, header_value);
+  FLUSH(CALLBACK, fragment);
+  FLUSH(CALLBACK, query_string);
+  FLUSH(CALLBACK, path);
+  FLUSH(CALLBACK, uri);
 
   assert(p <= pe && "buffer overflow after parsing execute");
 
@@ -396,6 +724,62 @@ int ebb_request_parser_is_finished(ebb_request_parser *parser)
   return parser->cs == ebb_request_parser_first_final;
 }
 
+size_t ebb_request_parser_relocate(ebb_request_parser *parser, const char *buffer, size_t len, char *new_buffer)
+{
+  ebb_request *request = CURRENT;
+  size_t start, end;
+  int i, n;
+
+  if(request == NULL || parser->request_start < 0) return 0;
+
+  start = parser->request_start;
+  /* once the headers are complete only the body is being read, and that
+   * has been handed to on_body already */
+  end = parser->headers_end >= 0 ? (size_t)parser->headers_end : len;
+  assert(start <= end && end <= len);
+
+  memmove(new_buffer, buffer + start, end - start);
+
+#define MOVE_OFFSET(X) if(parser->X >= 0) parser->X -= start
+#define MOVE_POINTER(P) P = new_buffer + ((P) - (buffer + start))
+  MOVE_OFFSET(request_start);
+  MOVE_OFFSET(headers_end);
+  MOVE_OFFSET(stored_field_start);
+  MOVE_OFFSET(stored_field_end);
+  MOVE_OFFSET(header_field_start);
+  MOVE_OFFSET(header_field_end);
+  MOVE_OFFSET(header_value_start);
+  MOVE_OFFSET(header_value_end);
+  MOVE_OFFSET(query_string_start);
+  MOVE_OFFSET(query_string_end);
+  MOVE_OFFSET(path_start);
+  MOVE_OFFSET(path_end);
+  MOVE_OFFSET(uri_start);
+  MOVE_OFFSET(uri_end);
+  MOVE_OFFSET(fragment_start);
+  MOVE_OFFSET(fragment_end);
+
+  if(request->store_headers) {
+    n = MIN(request->number_of_headers, EBB_MAX_HEADERS);
+    /* between the CR and LF of a header line its entry is stored but
+     * not yet counted. its slot gives it away. */
+    if(n < EBB_MAX_HEADERS && memchr(request->header_slots, n + 1, EBB_HEADER_SLOTS))
+      n++;
+    for(i = 0; i < n; i++) {
+      MOVE_POINTER(request->headers[i].field);
+      MOVE_POINTER(request->headers[i].value);
+    }
+  }
+  for(i = 0; i < EBB_NUMBER_OF_KNOWN_HEADERS; i++) {
+    if(request->known_headers[i])
+      MOVE_POINTER(request->known_headers[i]);
+  }
+#undef MOVE_OFFSET
+#undef MOVE_POINTER
+
+  return end - start;
+}
+
 void ebb_request_init(ebb_request *request)
 {
   request->expect_continue = FALSE;
@@ -404,8 +788,15 @@ void ebb_request_init(ebb_request *request)
   request->version_major = 0;
   request->version_minor = 0;
   request->number_of_headers = 0;
+  request->store_headers = FALSE;
+  memset(request->header_slots, 0, sizeof request->header_slots);
+  memset(request->known_headers, 0, sizeof request->known_headers);
+  request->accept_encoding = 0;
+  request->if_modified_since = -1;
+  request->range_start = request->range_end = -1;
   request->transfer_encoding = EBB_IDENTITY;
   request->keep_alive = -1;
+  request->connection = NULL;
 
   request->on_complete = NULL;
   request->on_headers_complete = NULL;
@@ -430,3 +821,21 @@ int ebb_request_should_keep_alive(ebb_request *request)
   else
     return request->keep_alive;
 }
+
+/**
+ * Looks up a header stored by the parser. Names are compared case
+ * insensitively. Only works if request->store_headers was set before
+ * the headers were parsed. Returns the first header with that name or
+ * NULL.
+ */
+ebb_header* ebb_request_find_header(ebb_request *request, const char *field, size_t length)
+{
+  unsigned int slot = header_hash(field, length) % EBB_HEADER_SLOTS;
+  while(request->header_slots[slot] != 0) {
+    ebb_header *header = &request->headers[request->header_slots[slot] - 1];
+    if(header->field_length == length && 0 == strncasecmp(header->field, field, length))
+      return header;
+    slot = (slot + 1) % EBB_HEADER_SLOTS;
+  }
+  return NULL;
+}
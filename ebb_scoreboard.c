@@ -0,0 +1,124 @@
+/* This file is part of libebb.
+ *
+ * Copyright (c) 2026 the libebb contributors
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <stdio.h>      /* perror */
+#include <stdlib.h>
+
+#include "ebb.h"
+
+#define BOARD_SIZE(nslots) (sizeof(ebb_scoreboard) + (nslots) * sizeof(ebb_score))
+
+/**
+ * Creates a scoreboard of nslots slots in the file path, replacing what
+ * was there, and maps it. Create it before forking or starting threads;
+ * give every server a slot with ebb_server_set_score. Returns NULL on
+ * failure.
+ *
+ * An old file is unlinked rather than truncated: a monitor that still
+ * has it mapped keeps reading the old board instead of getting SIGBUS.
+ */
+ebb_scoreboard*
+ebb_scoreboard_create(const char *path, int nslots)
+{
+  size_t size = BOARD_SIZE(nslots);
+  ebb_scoreboard *board;
+  int fd;
+
+  if(0 > unlink(path) && errno != ENOENT) {
+    perror("unlink()");
+    return NULL;
+  }
+  fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0644);
+  if(fd < 0) {
+    perror("open()");
+    return NULL;
+  }
+  if(0 > ftruncate(fd, size)) {
+    perror("ftruncate()");
+    close(fd);
+    return NULL;
+  }
+  board = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if(board == MAP_FAILED) {
+    perror("mmap()");
+    return NULL;
+  }
+  board->nslots = nslots;
+  board->slot_size = sizeof(ebb_score);
+  __atomic_store_n(&board->magic, EBB_SCOREBOARD_MAGIC, __ATOMIC_RELEASE);
+  return board;
+}
+
+/**
+ * Maps an existing scoreboard read-only, for a program watching the
+ * servers. Returns NULL if path is not a scoreboard of this version.
+ */
+ebb_scoreboard*
+ebb_scoreboard_open(const char *path)
+{
+  ebb_scoreboard *board;
+  struct stat st;
+  int fd;
+
+  fd = open(path, O_RDONLY);
+  if(fd < 0) {
+    perror("open()");
+    return NULL;
+  }
+  if(0 > fstat(fd, &st) || (size_t)st.st_size < sizeof(ebb_scoreboard)) {
+    close(fd);
+    return NULL;
+  }
+  board = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if(board == MAP_FAILED) {
+    perror("mmap()");
+    return NULL;
+  }
+  if(board->magic != EBB_SCOREBOARD_MAGIC
+  || board->slot_size != sizeof(ebb_score)
+  || BOARD_SIZE(board->nslots) > (size_t)st.st_size) {
+    munmap(board, st.st_size);
+    return NULL;
+  }
+  return board;
+}
+
+/**
+ * Unmaps the scoreboard. The file stays; remove it with unlink when no
+ * one needs it anymore.
+ */
+void
+ebb_scoreboard_close(ebb_scoreboard *board)
+{
+  munmap(board, BOARD_SIZE(board->nslots));
+}
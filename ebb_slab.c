@@ -0,0 +1,231 @@
+/* This file is part of libebb.
+ *
+ * Copyright (c) 2026 the libebb contributors
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include "ebb.h"
+
+#ifndef TRUE
+# define TRUE 1
+#endif
+#ifndef FALSE
+# define FALSE 0
+#endif
+
+#ifndef MAP_ANONYMOUS
+# define MAP_ANONYMOUS MAP_ANON
+#endif
+
+#define SMALLEST_CLASS 32
+#define LARGEST_CLASS (SMALLEST_CLASS << (EBB_SLAB_CLASSES - 1))
+
+/* Sits at the start of every chunk, so that ebb_slab_destroy can find
+ * them. Padded so objects start on a cache line.
+ */
+struct chunk {
+  struct chunk *next;
+  size_t size;
+  char pad[64 - sizeof(struct chunk*) - sizeof(size_t)];
+};
+
+/* Index into slab->free_lists of the smallest class size fits in. */
+static int
+size_class(size_t size)
+{
+  int i = 0;
+  size_t class_size = SMALLEST_CLASS;
+
+  while(class_size < size) {
+    class_size <<= 1;
+    i++;
+  }
+  return i;
+}
+
+/* Maps size bytes, on explicit hugepages if asked and possible. If not,
+ * the mapping is aligned so that transparent hugepages can back it.
+ * Returns NULL on failure.
+ */
+static void*
+map_chunk(size_t size, int hugepages, int *huge)
+{
+  char *p;
+  size_t head, tail;
+
+  *huge = FALSE;
+  if(!hugepages) {
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return p == MAP_FAILED ? NULL : p;
+  }
+
+#ifdef MAP_HUGETLB
+  p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if(p != MAP_FAILED) {
+    *huge = TRUE;
+    return p;
+  }
+#endif
+
+  /* no hugepages reserved, map more and trim to an aligned range */
+  p = mmap(NULL, size + EBB_SLAB_CHUNK, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(p == MAP_FAILED) return NULL;
+  head = (EBB_SLAB_CHUNK - (uintptr_t)p % EBB_SLAB_CHUNK) % EBB_SLAB_CHUNK;
+  tail = EBB_SLAB_CHUNK - head;
+  if(head > 0) munmap(p, head);
+  if(tail > 0) munmap(p + head + size, tail);
+  p += head;
+#ifdef MADV_HUGEPAGE
+  madvise(p, size, MADV_HUGEPAGE);
+#endif
+  return p;
+}
+
+/* Adds a chunk of at least size bytes and makes it the one objects are
+ * cut from. What was left of the previous chunk is lost.
+ */
+static int
+grow(ebb_slab *slab, size_t size)
+{
+  struct chunk *chunk;
+  int huge;
+
+  if(size < EBB_SLAB_CHUNK) size = EBB_SLAB_CHUNK;
+  size = (size + EBB_SLAB_CHUNK - 1) / EBB_SLAB_CHUNK * EBB_SLAB_CHUNK;
+  chunk = map_chunk(size, slab->hugepages, &huge);
+  if(chunk == NULL) return -1;
+
+  chunk->next = slab->chunks;
+  chunk->size = size;
+  slab->chunks = chunk;
+  slab->chunk_pos = (char*)(chunk + 1);
+  slab->chunk_end = (char*)chunk + size;
+  slab->chunk_count++;
+  if(huge) slab->huge_chunks++;
+  return 0;
+}
+
+static void*
+slab_alloc(ebb_allocator *allocator, size_t size)
+{
+  ebb_slab *slab = allocator->data;
+  size_t class_size;
+  void *object;
+  int i;
+
+  if(size > LARGEST_CLASS) {
+    object = malloc(size);
+    if(object) slab->oversized++;
+    return object;
+  }
+
+  i = size_class(size);
+  object = slab->free_lists[i];
+  if(object) {
+    slab->free_lists[i] = *(void**)object;
+    slab->in_use++;
+    return object;
+  }
+
+  class_size = (size_t)SMALLEST_CLASS << i;
+  if(slab->chunk_pos == NULL || slab->chunk_end - slab->chunk_pos < (ptrdiff_t)class_size) {
+    if(0 > grow(slab, EBB_SLAB_CHUNK)) return NULL;
+  }
+  object = slab->chunk_pos;
+  slab->chunk_pos += class_size;
+  slab->in_use++;
+  return object;
+}
+
+static void
+slab_free(ebb_allocator *allocator, void *object, size_t size)
+{
+  ebb_slab *slab = allocator->data;
+  int i;
+
+  if(size > LARGEST_CLASS) {
+    free(object);
+    slab->oversized--;
+    return;
+  }
+  i = size_class(size);
+  *(void**)object = slab->free_lists[i];
+  slab->free_lists[i] = object;
+  slab->in_use--;
+}
+
+/**
+ * Initializes a slab and maps reserve bytes for it up front (at least
+ * one chunk of EBB_SLAB_CHUNK); it grows by a chunk at a time later.
+ * With hugepages the chunks are put on explicit hugepages if any are
+ * reserved (vm.nr_hugepages), otherwise the kernel is asked to back
+ * them with transparent ones. Returns 0, or -1 if no memory could be
+ * mapped.
+ *
+ * Give &slab->allocator to the servers of one loop. A slab is not
+ * thread-safe, use one per loop.
+ */
+int
+ebb_slab_init(ebb_slab *slab, size_t reserve, int hugepages)
+{
+  memset(slab->free_lists, 0, sizeof(slab->free_lists));
+  slab->chunk_pos = NULL;
+  slab->chunk_end = NULL;
+  slab->chunks = NULL;
+  slab->hugepages = hugepages ? TRUE : FALSE;
+  slab->chunk_count = 0;
+  slab->huge_chunks = 0;
+  slab->in_use = 0;
+  slab->oversized = 0;
+
+  slab->allocator.alloc = slab_alloc;
+  slab->allocator.free = slab_free;
+  slab->allocator.data = slab;
+
+  return grow(slab, reserve);
+}
+
+/**
+ * Unmaps all chunks. Everything allocated from the slab is gone with
+ * them, except oversized objects, which must have been freed already.
+ */
+void
+ebb_slab_destroy(ebb_slab *slab)
+{
+  struct chunk *chunk = slab->chunks;
+
+  while(chunk) {
+    struct chunk *next = chunk->next;
+    munmap(chunk, chunk->size);
+    chunk = next;
+  }
+  slab->chunks = NULL;
+  slab->chunk_pos = NULL;
+  slab->chunk_end = NULL;
+  memset(slab->free_lists, 0, sizeof(slab->free_lists));
+}
@@ -3,35 +3,88 @@
 #include <string.h>
 #include <unistd.h>
 #include <assert.h>
+#include <signal.h>
+#include <sys/socket.h>
 
 #include <ev.h>
 #include "ebb.h"
 
-#define MSG ("HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: 12\r\n\r\nhello world\n")
+#define HEADER "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: 12\r\n\r\n"
+#define BODY "hello world\n"
 static int c = 0;
+static ebb_pool pool;
+static int offload = 0;
+static int use_handles = 0;
+static int use_slab = 0;
+static int hugepages = 0;
+static int keep_alive = 0;
 
 struct hello_connection {
   unsigned int responses_to_write;
+  unsigned close_when_done:1;
 };
 
 void on_close(ebb_connection *connection)
 {
-  free(connection->data);
-  free(connection);
+  ebb_server *server = connection->server;
+  ebb_server_free(server, connection->data, sizeof(struct hello_connection));
+  ebb_server_free(server, connection, sizeof(ebb_connection));
 }
 
-static void continue_responding(ebb_connection *connection)
+/* Requests the client has sent but the loop has not read yet. Closing
+ * on top of them would reset the connection and lose the responses.
+ */
+static int more_to_read(ebb_connection *connection)
+{
+  char byte;
+  return 0 < recv(connection->fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+}
+
+static void response_written(ebb_connection *connection)
 {
-  int r;
   struct hello_connection *connection_data = connection->data;
   //printf("response complete \n");
-  if(--connection_data->responses_to_write > 0) {
-    /* write another response */
-    r = ebb_connection_write(connection, MSG, sizeof MSG, continue_responding);
-    assert(r);
-  } else {
+  if(--connection_data->responses_to_write == 0
+    && connection_data->close_when_done
+    && !more_to_read(connection))
     ebb_connection_schedule_close(connection);
-  }
+}
+
+static void write_response(ebb_connection *connection, void *data)
+{
+  struct hello_connection *connection_data = connection->data;
+
+  /* pipelined responses queue up behind each other */
+  struct iovec iov[2];
+  iov[0].iov_base = HEADER;
+  iov[0].iov_len = sizeof(HEADER) - 1;
+  iov[1].iov_base = BODY;
+  iov[1].iov_len = sizeof(BODY) - 1;
+  if(!ebb_connection_writev(connection, iov, 2, response_written, NULL, NULL))
+    connection_data->responses_to_write--;
+}
+
+/* stands in for work that would block the loop */
+static void think(void *arg)
+{
+  usleep(1000);
+}
+
+static void response_released(ebb_connection *connection, void *data)
+{
+  /* NULL if the connection closed before the response got there */
+  if(connection)
+    response_written(connection);
+}
+
+/* answers from a pool thread, through the connection's handle */
+static void think_and_respond(void *arg)
+{
+  ebb_handle *handle = arg;
+  think(NULL);
+  if(0 > ebb_handle_write(*handle, HEADER BODY, sizeof(HEADER BODY) - 1, response_released, NULL))
+    fprintf(stderr, "connection gone\n");
+  free(handle);
 }
 
 static void request_complete(ebb_request *request)
@@ -40,20 +93,37 @@ static void request_complete(ebb_request *request)
   ebb_connection *connection = request->data;
   struct hello_connection *connection_data = connection->data;
 
-  if(ebb_request_should_keep_alive(request))
-    connection_data->responses_to_write++;
-  else
-    connection_data->responses_to_write = 1;
+  /* without --keep-alive the connection is closed once everything
+   * asked for so far has been answered */
+  if(!keep_alive || !ebb_request_should_keep_alive(request))
+    connection_data->close_when_done = 1;
 
-  ebb_connection_write(connection, MSG, sizeof MSG, continue_responding);
-  free(request);
+  /* counted now so that the connection is not closed while offloaded
+   * requests are still out. With several pool threads they may finish
+   * out of order. All responses are the same here; a real server would
+   * have to put them back in order.
+   * The request's header values are only valid until this returns, so
+   * offloaded work must copy what it needs of them first, with
+   * ebb_request_strndup for instance. think() needs nothing. */
+  connection_data->responses_to_write++;
+  if(use_handles) {
+    ebb_handle *handle = malloc(sizeof(ebb_handle));
+    *handle = ebb_connection_handle(connection);
+    if(0 > ebb_connection_offload(connection, think_and_respond, handle, NULL)) {
+      free(handle);
+      write_response(connection, NULL);
+    }
+  } else if(!offload || 0 > ebb_connection_offload(connection, think, NULL, write_response)) {
+    write_response(connection, NULL);
+  }
 }
 
 static ebb_request* new_request(ebb_connection *connection)
 {
   //printf("request %d\n", ++c);
-  ebb_request *request = malloc(sizeof(ebb_request));
-  ebb_request_init(request);
+  ebb_request *request = ebb_connection_reuse_request(connection);
+  if(request == NULL)
+    return NULL;
   request->data = connection;
   request->on_complete = request_complete;
   return request;
@@ -61,14 +131,15 @@ static ebb_request* new_request(ebb_connection *connection)
 
 ebb_connection* new_connection(ebb_server *server, struct sockaddr_in *addr)
 {
-  struct hello_connection *connection_data = malloc(sizeof(struct hello_connection));
+  struct hello_connection *connection_data = ebb_server_alloc(server, sizeof(struct hello_connection));
   if(connection_data == NULL)
     return NULL;
   connection_data->responses_to_write = 0;
+  connection_data->close_when_done = 0;
 
-  ebb_connection *connection = malloc(sizeof(ebb_connection));
+  ebb_connection *connection = ebb_server_alloc(server, sizeof(ebb_connection));
   if(connection == NULL) {
-    free(connection_data);
+    ebb_server_free(server, connection_data, sizeof(struct hello_connection));
     return NULL;
   }
 
@@ -81,13 +152,140 @@ ebb_connection* new_connection(ebb_server *server, struct sockaddr_in *addr)
   return connection;
 }
 
-int main(int argc, char **_) 
+/* a slab per loop, when started with --slab or --hugepages */
+static ebb_allocator* new_slab(void)
+{
+  ebb_slab *slab = malloc(sizeof(ebb_slab));
+  if(slab == NULL || 0 > ebb_slab_init(slab, EBB_SLAB_CHUNK, hugepages)) {
+    free(slab);
+    return NULL;
+  }
+  return &slab->allocator;
+}
+
+static ev_signal term_watcher;
+static ebb_scoreboard *scoreboard = NULL;
+
+static void on_term(struct ev_loop *loop, ev_signal *watcher, int revents)
+{
+  ebb_prefork *prefork = watcher->data;
+  ev_signal_stop(loop, watcher);
+  ebb_prefork_stop(prefork);
+}
+
+static void run_worker(ebb_prefork *prefork, int index)
 {
   struct ev_loop *loop = ev_default_loop(0);
   ebb_server server;
 
+  ev_signal_stop(loop, &term_watcher);
+  ebb_server_init(&server, loop);
+  server.new_connection = new_connection;
+  server.coalesce_writes = *(int*)prefork->data;
+  server.exclusive_accept = 1;
+  if(use_slab)
+    server.allocator = new_slab();
+  if(scoreboard)
+    ebb_server_set_score(&server, &scoreboard->slots[index]);
+  ebb_server_listen_on_fd(&server, prefork->fd);
+  strcpy(server.port, prefork->port);
+  ev_loop(loop, 0);
+}
+
+int main(int argc, char **argv) 
+{
+  struct ev_loop *loop = ev_default_loop(0);
+  ebb_server server;
+  ebb_group group;
+  ebb_prefork prefork;
+  int processes = 0;
+  const char *scoreboard_path = NULL;
+  int i, coalesce = 0, threads = 0, acceptor = 0, balance = 0;
+
+  for(i = 1; i < argc; i++) {
+    if(strcmp(argv[i], "--coalesce") == 0)
+      coalesce = 1;
+    else if(strcmp(argv[i], "--acceptor") == 0)
+      acceptor = 1;
+    else if(strcmp(argv[i], "--balance") == 0)
+      balance = 1;
+    else if(strcmp(argv[i], "--offload") == 0)
+      offload = 1;
+    else if(strcmp(argv[i], "--slab") == 0)
+      use_slab = 1;
+    else if(strcmp(argv[i], "--hugepages") == 0)
+      use_slab = hugepages = 1;
+    else if(strcmp(argv[i], "--keep-alive") == 0)
+      keep_alive = 1;
+    else if(strcmp(argv[i], "--handles") == 0)
+      offload = use_handles = 1;
+    else if(strcmp(argv[i], "--processes") == 0 && i + 1 < argc)
+      processes = atoi(argv[++i]);
+    else if(strcmp(argv[i], "--scoreboard") == 0 && i + 1 < argc)
+      scoreboard_path = argv[++i];
+    else if(strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+      threads = atoi(argv[++i]);
+  }
+
+  if(offload && 0 > ebb_pool_init(&pool, 4))
+    return 1;
+
+  /* one slot per process or thread; examples/scoreboard reads it */
+  if(scoreboard_path) {
+    int nslots = processes > 0 ? processes : threads > 0 ? threads : 1;
+    scoreboard = ebb_scoreboard_create(scoreboard_path, nslots);
+    if(scoreboard == NULL)
+      return 1;
+  }
+
+  if(processes > 0) {
+    /* a supervisor and worker processes sharing port 5000 */
+    ebb_prefork_init(&prefork);
+    prefork.on_worker = run_worker;
+    prefork.data = &coalesce;
+    if(0 > ebb_prefork_listen_on_port(&prefork, 5000))
+      return 1;
+    printf("hello_world listening on port 5000 with %d processes\n", processes);
+    fflush(stdout);
+    ev_signal_init(&term_watcher, on_term, SIGTERM);
+    term_watcher.data = &prefork;
+    ev_signal_start(loop, &term_watcher);
+    if(0 > ebb_prefork_start(&prefork, processes))
+      return 1;
+    ev_loop(loop, 0);
+    return 0;
+  }
+
+  if(threads > 0) {
+    /* one server and loop per thread, all on port 5000 */
+    if(0 > ebb_group_init(&group, threads))
+      return 1;
+    group.new_connection = new_connection;
+    group.use_acceptor = acceptor;
+    if(balance)
+      group.balance_interval = 0.5;
+    for(i = 0; i < group.nservers; i++) {
+      group.servers[i].coalesce_writes = coalesce;
+      group.servers[i].pool = offload ? &pool : NULL;
+      if(use_slab)
+        group.servers[i].allocator = new_slab();
+      if(scoreboard)
+        ebb_server_set_score(&group.servers[i], &scoreboard->slots[i]);
+    }
+    printf("hello_world listening on port 5000 with %d threads\n", group.nservers);
+    ebb_group_listen_on_port(&group, 5000);
+    ebb_group_start(&group);
+    for(;;) pause();
+  }
+
   ebb_server_init(&server, loop); 
   server.new_connection = new_connection;
+  server.coalesce_writes = coalesce;
+  server.pool = offload ? &pool : NULL;
+  if(use_slab)
+    server.allocator = new_slab();
+  if(scoreboard)
+    ebb_server_set_score(&server, &scoreboard->slots[0]);
 
   printf("hello_world listening on port 5000\n");
   ebb_server_listen_on_port(&server, 5000);
@@ -0,0 +1,57 @@
+/* Prints the scoreboard of running libebb servers.
+ *
+ *   ./scoreboard /dev/shm/hello_world [seconds between updates]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <ev.h>
+#include "ebb.h"
+
+#define LOAD(field) __atomic_load_n(&field, __ATOMIC_RELAXED)
+
+int main(int argc, char **argv)
+{
+  ebb_scoreboard *board;
+  int i, interval;
+
+  if(argc < 2) {
+    fprintf(stderr, "usage: %s scoreboard [seconds]\n", argv[0]);
+    return 1;
+  }
+  board = ebb_scoreboard_open(argv[1]);
+  if(board == NULL) {
+    fprintf(stderr, "%s is not a scoreboard\n", argv[1]);
+    return 1;
+  }
+  interval = argc > 2 ? atoi(argv[2]) : 0;
+
+  do {
+    printf("%4s %7s %11s %11s %13s %13s %7s %8s %8s\n", "slot", "pid",
+        "connections", "requests", "bytes in", "bytes out", "errors",
+        "timeouts", "lag ms");
+    for(i = 0; i < board->nslots; i++) {
+      ebb_score *score = &board->slots[i];
+      if(!__atomic_load_n(&score->in_use, __ATOMIC_ACQUIRE)) continue;
+      printf("%4d %7u %11llu %11llu %13llu %13llu %7llu %8llu %8.1f\n"
+            , i
+            , LOAD(score->pid)
+            , (unsigned long long)LOAD(score->connections)
+            , (unsigned long long)LOAD(score->requests)
+            , (unsigned long long)LOAD(score->bytes_in)
+            , (unsigned long long)LOAD(score->bytes_out)
+            , (unsigned long long)LOAD(score->parse_errors)
+            , (unsigned long long)LOAD(score->timeouts)
+            , LOAD(score->loop_lag) / 1000.
+            );
+    }
+    if(interval > 0) {
+      printf("\n");
+      sleep(interval);
+    }
+  } while(interval > 0);
+
+  ebb_scoreboard_close(board);
+  return 0;
+}
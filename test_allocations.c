@@ -0,0 +1,216 @@
+/* checks that a server with a slab allocator, reused requests, request
+ * arenas and shared buffers does no heap allocations once it is warmed
+ * up
+ * Copyright 2026 the libebb contributors
+ *
+ * This software may be distributed under the "MIT" license included in the
+ * README
+ *
+ * malloc and friends are replaced to count calls, which needs glibc.
+ * The client ends of socketpairs are driven from the same thread as the
+ * server's loop.
+ */
+#include <stdlib.h>
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <ev.h>
+#include "ebb.h"
+
+#define REQUEST "GET /hello HTTP/1.1\r\nHost: localhost\r\n\r\n"
+#define HEADER "HTTP/1.1 200 OK\r\nContent-Length: 12\r\n\r\n"
+#define BODY "hello world\n"
+#define RESPONSE HEADER BODY
+#define PIPELINE 16
+
+static unsigned long allocations;
+
+#ifdef __GLIBC__
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+void *malloc(size_t size)
+{
+  allocations++;
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+  allocations++;
+  return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+  allocations++;
+  return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr)
+{
+  __libc_free(ptr);
+}
+#endif
+
+static struct ev_loop *loop;
+static ebb_server server;
+static ebb_slab slab;
+static ebb_buf body;
+static int completed;
+static int closed;
+
+/* The response header is built in the request's arena, which must stay
+ * until it has been sent. A big scratch allocation takes the other path.
+ * The body is the same buffer for every response.
+ */
+static void on_complete(ebb_request *request)
+{
+  ebb_connection *connection = request->data;
+  char *header = ebb_request_strndup(request, HEADER, sizeof(HEADER) - 1);
+  char *scratch = ebb_request_alloc(request, EBB_ARENA_CHUNK);
+  int r;
+
+  assert(header && scratch);
+  assert(((size_t)scratch & 15) == 0);
+  memset(scratch, 'x', EBB_ARENA_CHUNK);
+  r = ebb_connection_write(connection, header, sizeof(HEADER) - 1, NULL);
+  assert(r);
+  r = ebb_connection_write_buf(connection, &body, NULL);
+  assert(r);
+  completed++;
+}
+
+static ebb_request* new_request(ebb_connection *connection)
+{
+  ebb_request *request = ebb_connection_reuse_request(connection);
+  request->data = connection;
+  request->on_complete = on_complete;
+  return request;
+}
+
+static void on_close(ebb_connection *connection)
+{
+  ebb_server_free(connection->server, connection, sizeof(ebb_connection));
+  closed++;
+}
+
+static ebb_connection* new_connection(ebb_server *s, struct sockaddr_in *addr)
+{
+  ebb_connection *connection = ebb_server_alloc(s, sizeof(ebb_connection));
+  ebb_connection_init(connection);
+  connection->new_request = new_request;
+  connection->on_close = on_close;
+  return connection;
+}
+
+/* Returns the client end of a new connection to the server. */
+static int connect_client(void)
+{
+  struct sockaddr_in addr;
+  int fds[2], r;
+
+  r = socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+  assert(r == 0);
+  r = fcntl(fds[1], F_SETFL, O_NONBLOCK);
+  assert(r == 0);
+  memset(&addr, 0, sizeof(addr));
+  r = ebb_server_adopt(&server, fds[1], &addr);
+  assert(r == 0);
+  return fds[0];
+}
+
+/* Sends PIPELINE requests at once and runs the loop until all the
+ * responses are back.
+ */
+static void round_trip(int client)
+{
+  char buf[PIPELINE * sizeof(RESPONSE)];
+  size_t want = PIPELINE * (sizeof(RESPONSE) - 1), got = 0;
+  int i;
+
+  for(i = 0; i < PIPELINE; i++) {
+    ssize_t w = write(client, REQUEST, sizeof(REQUEST) - 1);
+    assert(w == sizeof(REQUEST) - 1);
+  }
+
+  while(got < want) {
+    ssize_t r;
+    ev_run(loop, EVRUN_NOWAIT);
+    r = recv(client, buf + got, sizeof(buf) - got, MSG_DONTWAIT);
+    if(r > 0) got += r;
+  }
+  assert(got == want);
+  assert(0 == memcmp(buf + got - (sizeof(RESPONSE) - 1), RESPONSE, sizeof(RESPONSE) - 1));
+}
+
+/* Opens a connection, makes a round trip on it and closes it again. */
+static void connection_lifetime(void)
+{
+  int client = connect_client();
+  int was_closed = closed;
+
+  round_trip(client);
+  close(client);
+  while(closed == was_closed)
+    ev_run(loop, EVRUN_NOWAIT);
+}
+
+int main(void)
+{
+  unsigned long before;
+  int client, i, r;
+
+#ifndef __GLIBC__
+  printf("skipped, counting allocations needs glibc\n");
+  return 0;
+#endif
+
+  loop = ev_default_loop(0);
+  ebb_server_init(&server, loop);
+  r = ebb_slab_init(&slab, EBB_SLAB_CHUNK, 0);
+  assert(r == 0);
+  server.allocator = &slab.allocator;
+  server.new_connection = new_connection;
+  ebb_buf_init(&body, BODY, sizeof(BODY) - 1);
+
+  /* requests on a keep-alive connection */
+  client = connect_client();
+  for(i = 0; i < 100; i++)
+    round_trip(client);
+  before = allocations;
+  for(i = 0; i < 1000; i++)
+    round_trip(client);
+  assert(completed == 1100 * PIPELINE);
+  assert(allocations == before);
+  /* once the loop has cleaned up after the last writes only the
+   * connection, its request and the server's spare read buffers are
+   * left, nothing from the arenas */
+  ev_run(loop, EVRUN_NOWAIT);
+  assert(slab.in_use == 2 + server.free_buffer_count);
+  assert(body.refs == 1);
+
+  /* whole connections */
+  for(i = 0; i < 10; i++)
+    connection_lifetime();
+  before = allocations;
+  for(i = 0; i < 100; i++)
+    connection_lifetime();
+  assert(closed == 110);
+  assert(allocations == before);
+
+  assert(slab.oversized == 0);
+  close(client);
+  while(closed == 110)
+    ev_run(loop, EVRUN_NOWAIT);
+  assert(slab.in_use == server.free_buffer_count);
+  ebb_slab_destroy(&slab);
+
+  printf("okay\n");
+  return 0;
+}
@@ -57,4 +57,23 @@ class EbbTest < Test::Unit::TestCase
     response.scan("hello world") { count += 1 }
     assert_equal 4, count
   end
+
+  def test_large_header
+    req = "GET /hello/1 HTTP/1.1\r\nCookie: %s\r\n\r\n" % ("x" * 20000)
+    @socket.full_send(req)
+    response = @socket.full_read()
+    count = 0
+    response.scan("hello world") { count += 1 }
+    assert_equal 1, count
+  end
+
+  def test_long_pipeline
+    req = ""
+    200.times { |i| req += "GET /hello/%d HTTP/1.1\r\nUser-Agent: %s\r\n\r\n" % [i, "y" * 100] }
+    @socket.full_send(req)
+    response = @socket.full_read()
+    count = 0
+    response.scan("hello world") { count += 1 }
+    assert_equal 200, count
+  end
 end
@@ -0,0 +1,50 @@
+require 'test/unit'
+require 'socket'
+require 'timeout'
+
+# run against examples/hello_world --keep-alive
+REQ = "GET /hello/%d HTTP/1.1\r\n\r\n"
+LAST_REQ = "GET /hello/%d HTTP/1.1\r\nConnection: close\r\n\r\n"
+HOST = '0.0.0.0'
+PORT = 5000
+
+class TCPSocket
+  # reads until count responses have come in
+  def read_responses(count)
+    response = ""
+    Timeout.timeout(5) do
+      while response.scan("hello world").length < count
+        response += readpartial(10000)
+      end
+    end
+    response
+  end
+end
+
+class EbbKeepAliveTest < Test::Unit::TestCase
+  def setup
+    @socket = TCPSocket.new(HOST, PORT)
+  end
+
+  def teardown
+    @socket.close
+  end
+
+  def test_requests_on_one_connection
+    3.times do |i|
+      @socket.write(REQ % i)
+      assert_equal 1, @socket.read_responses(1).scan("hello world").length
+    end
+    @socket.write(LAST_REQ % 3)
+    @socket.read_responses(1)
+    assert_nil @socket.read(1)
+  end
+
+  def test_pipeline_then_request
+    @socket.write((REQ % 1) + (REQ % 2) + (REQ % 3))
+    assert_equal 3, @socket.read_responses(3).scan("hello world").length
+    @socket.write(LAST_REQ % 4)
+    @socket.read_responses(1)
+    assert_nil @socket.read(1)
+  end
+end
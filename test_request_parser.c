@@ -279,6 +279,42 @@ const struct request_data chunked_w_bullshit_after_length =
   , body: "hello world"
   };
 
+// long header values are skipped over in one go
+const struct request_data get_long_cookie =
+  { raw: "GET /get_long_cookie HTTP/1.1\r\n"
+         "Cookie: session=0123456789abcdef0123456789abcdef; prefs=lang%3Den%7Ctz%3DUTC; tracking=aGVsbG8gd29ybGQgaGVsbG8gd29ybGQ\r\n"
+         "Connection: close\r\n"
+         "\r\n"
+  , should_keep_alive: FALSE
+  , request_method: EBB_GET
+  , query_string: ""
+  , fragment: ""
+  , request_path: "/get_long_cookie"
+  , request_uri: "/get_long_cookie"
+  , num_headers: 2
+  , header_fields: { "Cookie", "Connection" }
+  , header_values: { "session=0123456789abcdef0123456789abcdef; prefs=lang%3Den%7Ctz%3DUTC; tracking=aGVsbG8gd29ybGQgaGVsbG8gd29ybGQ", "close" }
+  , body: ""
+  };
+
+// an empty value is not skipped into the next header line
+const struct request_data get_empty_header =
+  { raw: "GET /get_empty_header HTTP/1.1\r\n"
+         "X-Empty:\r\n"
+         "Cookie: a=b\r\n"
+         "\r\n"
+  , should_keep_alive: TRUE
+  , request_method: EBB_GET
+  , query_string: ""
+  , fragment: ""
+  , request_path: "/get_empty_header"
+  , request_uri: "/get_empty_header"
+  , num_headers: 2
+  , header_fields: { "X-Empty", "Cookie" }
+  , header_values: { "", "a=b" }
+  , body: ""
+  };
+
 const struct request_data *fixtures[] =
   { &curl_get 
   , &firefox_get 
@@ -292,6 +328,8 @@ const struct request_data *fixtures[] =
   , &two_chunks_mult_zero_end  
   , &chunked_w_trailing_headers  
   , &chunked_w_bullshit_after_length  
+  , &get_long_cookie
+  , &get_empty_header
   , NULL
   };
 
@@ -344,6 +382,22 @@ int request_data_eq
       printf("header field '%s' != '%s'\n", r1->header_values[i], r2->header_values[i]);
       return FALSE;
     }
+    if(i >= EBB_MAX_HEADERS) continue;
+    ebb_header *header = &r1->request.headers[i];
+    if(strlen(r2->header_fields[i]) != header->field_length ||
+       0 != strncmp(r2->header_fields[i], header->field, header->field_length)) {
+      printf("stored header field '%.*s' != '%s'\n", (int)header->field_length, header->field, r2->header_fields[i]);
+      return FALSE;
+    }
+    if(strlen(r2->header_values[i]) != header->value_length ||
+       0 != strncmp(r2->header_values[i], header->value, header->value_length)) {
+      printf("stored header value '%.*s' != '%s'\n", (int)header->value_length, header->value, r2->header_values[i]);
+      return FALSE;
+    }
+    if(header != ebb_request_find_header(&r1->request, header->field, header->field_length)) {
+      printf("lookup of '%s' failed\n", r2->header_fields[i]);
+      return FALSE;
+    }
   }
   return TRUE;
 }
@@ -425,6 +479,7 @@ ebb_request* new_request ()
   r->on_query_string = query_string_cb;
   r->on_body = body_handler;
   r->on_headers_complete = NULL;
+  r->store_headers = TRUE;
 
   r->data = &requests[num_requests];
  // printf("new request %d\n", num_requests);
@@ -450,6 +505,7 @@ int test_request
   traversed = ebb_request_parser_execute( &parser
                                         , request_data->raw 
                                         , strlen(request_data->raw)
+                                        , 0
                                         );
   if( ebb_request_parser_has_error(&parser) )
     return FALSE;
@@ -468,7 +524,7 @@ int test_error
   size_t traversed = 0;
   parser_init();
 
-  traversed = ebb_request_parser_execute(&parser, buf, strlen(buf));
+  traversed = ebb_request_parser_execute(&parser, buf, strlen(buf), 0);
 
   return ebb_request_parser_has_error(&parser);
 }
@@ -489,7 +545,7 @@ int test_multiple3
   size_t traversed = 0;
   parser_init();
 
-  traversed = ebb_request_parser_execute(&parser, total, strlen(total));
+  traversed = ebb_request_parser_execute(&parser, total, strlen(total), 0);
 
 
   if( ebb_request_parser_has_error(&parser) )
@@ -527,8 +583,6 @@ int test_scan2
   )
 {
   char total[80*1024] = "\0";
-  char buf1[80*1024] = "\0";
-  char buf2[80*1024] = "\0";
 
   strcat(total, r1->raw); 
   strcat(total, r2->raw); 
@@ -542,15 +596,11 @@ int test_scan2
 
     parser_init();
 
+    /* the parser expects all pieces of a request in one buffer */
     int buf1_len = i;
-    strncpy(buf1, total, buf1_len);
-    buf1[buf1_len] = 0;
-
     int buf2_len = total_len - i;
-    strncpy(buf2, total+i, buf2_len);
-    buf2[buf2_len] = 0;
 
-    ebb_request_parser_execute(&parser, buf1, buf1_len);
+    ebb_request_parser_execute(&parser, total, buf1_len, 0);
 
     if( ebb_request_parser_has_error(&parser) ) {
       return FALSE;
@@ -560,7 +610,7 @@ int test_scan2
       return FALSE;
     */
 
-    ebb_request_parser_execute(&parser, buf2, buf2_len);
+    ebb_request_parser_execute(&parser, total, buf2_len, buf1_len);
 
     if( ebb_request_parser_has_error(&parser))
       return FALSE;
@@ -595,9 +645,6 @@ int test_scan3
   )
 {
   char total[80*1024] = "\0";
-  char buf1[80*1024] = "\0";
-  char buf2[80*1024] = "\0";
-  char buf3[80*1024] = "\0";
 
   strcat(total, r1->raw); 
   strcat(total, r2->raw); 
@@ -616,36 +663,22 @@ int test_scan3
 
 
       int buf1_len = i;
-      strncpy(buf1, total, buf1_len);
-      buf1[buf1_len] = 0;
-
       int buf2_len = j - i;
-      strncpy(buf2, total+i, buf2_len);
-      buf2[buf2_len] = 0;
-
       int buf3_len = total_len - j;
-      strncpy(buf3, total+j, buf3_len);
-      buf3[buf3_len] = 0;
 
-      /*
-      printf("buf1: %s - %d\n", buf1, buf1_len);
-      printf("buf2: %s - %d \n", buf2, buf2_len );
-      printf("buf3: %s - %d\n\n", buf3, buf3_len);
-      */
-
-      ebb_request_parser_execute(&parser, buf1, buf1_len);
+      ebb_request_parser_execute(&parser, total, buf1_len, 0);
 
       if( ebb_request_parser_has_error(&parser) ) {
         return FALSE;
       }
 
-      ebb_request_parser_execute(&parser, buf2, buf2_len);
+      ebb_request_parser_execute(&parser, total, buf2_len, i);
 
       if( ebb_request_parser_has_error(&parser) ) {
         return FALSE;
       }
 
-      ebb_request_parser_execute(&parser, buf3, buf3_len);
+      ebb_request_parser_execute(&parser, total, buf3_len, j);
 
       if( ebb_request_parser_has_error(&parser))
         return FALSE;
@@ -674,6 +707,127 @@ int test_scan3
   return TRUE;
 }
 
+/* like test_scan2 but the second piece goes into a different buffer, as
+ * when ebb.c compacts or grows its read buffer between reads */
+int test_relocate
+  ( const struct request_data *r1
+  , const struct request_data *r2
+  , const struct request_data *r3
+  )
+{
+  static char total[80*1024], moved[80*1024];
+  total[0] = '\0';
+
+  strcat(total, r1->raw); 
+  strcat(total, r2->raw); 
+  strcat(total, r3->raw); 
+
+  int total_len = strlen(total);
+  int i;
+  for(i = 1; i < total_len - 1; i ++ ) {
+    size_t kept;
+    int start;
+
+    parser_init();
+    ebb_request_parser_execute(&parser, total, i, 0);
+    if( ebb_request_parser_has_error(&parser) )
+      return FALSE;
+
+    start = parser.current_request ? parser.request_start : i;
+    memset(moved, 'X', sizeof moved);
+    kept = ebb_request_parser_relocate(&parser, total, i, moved);
+    /* anything still pointing at the old bytes will notice */
+    memset(total + start, 'X', i - start);
+    memcpy(moved + kept, total + i, total_len - i);
+    ebb_request_parser_execute(&parser, moved, total_len - i, kept);
+
+    if( ebb_request_parser_has_error(&parser))
+      return FALSE;
+    if(!ebb_request_parser_is_finished(&parser)) 
+      return FALSE;
+
+    if(3 != num_requests) {
+      printf("relocate error: got %d requests in iteration %d\n", num_requests, i);
+      return FALSE;
+    }
+    if(!request_eq(0, r1) || !request_eq(1, r2) || !request_eq(2, r3)) {
+      printf("relocate error: requests differ in iteration %d\n", i);
+      return FALSE;
+    }
+
+    /* restore the bytes overwritten above */
+    total[0] = '\0';
+    strcat(total, r1->raw); 
+    strcat(total, r2->raw); 
+    strcat(total, r3->raw); 
+  }
+  return TRUE;
+}
+
+int test_known_headers()
+{
+  const char *raw = "GET /index.html HTTP/1.1\r\n"
+                    "HOST: example.com\r\n"
+                    "Cookie: a=1; b=2\r\n"
+                    "Accept-Encoding: gzip;q=1.0, deflate;q=0, br\r\n"
+                    "If-Modified-Since: Sun, 06 Nov 1994 08:49:37 GMT\r\n"
+                    "range: bytes=500-\r\n"
+                    "X-Host: not the host\r\n"
+                    "Cookie: ignored=1\r\n"
+                    "\r\n";
+  ebb_request *r;
+
+  parser_init();
+  ebb_request_parser_execute(&parser, raw, strlen(raw), 0);
+  if(ebb_request_parser_has_error(&parser) || num_requests != 1)
+    return FALSE;
+  r = &requests[0].request;
+
+  if(r->known_header_lengths[EBB_HEADER_HOST] != 11 ||
+     0 != strncmp("example.com", r->known_headers[EBB_HEADER_HOST], 11))
+    return FALSE;
+  if(r->known_header_lengths[EBB_HEADER_COOKIE] != 8 ||
+     0 != strncmp("a=1; b=2", r->known_headers[EBB_HEADER_COOKIE], 8))
+    return FALSE;
+  if(r->known_headers[EBB_HEADER_CONTENT_TYPE] != NULL)
+    return FALSE;
+  if(r->accept_encoding != (EBB_ACCEPT_GZIP | EBB_ACCEPT_BR))
+    return FALSE;
+  if(r->if_modified_since != 784111777)
+    return FALSE;
+  if(r->range_start != 500 || r->range_end != -1)
+    return FALSE;
+  if(r->headers[0].id != EBB_HEADER_HOST || r->headers[5].id != EBB_HEADER_OTHER)
+    return FALSE;
+
+  return TRUE;
+}
+
+/* Parses a request with the given header line and returns it. */
+static ebb_request* parse_with_header(const char *header)
+{
+  char raw[512];
+
+  snprintf(raw, sizeof raw, "GET / HTTP/1.1\r\n%s\r\n\r\n", header);
+  parser_init();
+  ebb_request_parser_execute(&parser, raw, strlen(raw), 0);
+  if(ebb_request_parser_has_error(&parser) || num_requests != 1)
+    return NULL;
+  return &requests[0].request;
+}
+
+int test_range(const char *header, off_t start, off_t end)
+{
+  ebb_request *r = parse_with_header(header);
+  return r && r->range_start == start && r->range_end == end;
+}
+
+int test_date(const char *header, time_t t)
+{
+  ebb_request *r = parse_with_header(header);
+  return r && r->if_modified_since == t;
+}
+
 int main() 
 {
 
@@ -683,6 +837,24 @@ int main()
   assert(test_request(&curl_get));
   assert(test_request(&firefox_get));
 
+  ebb_header *header = ebb_request_find_header(&requests[0].request, "accept-encoding", 15);
+  assert(header != NULL);
+  assert(0 == strncmp("gzip,deflate", header->value, header->value_length));
+  assert(NULL == ebb_request_find_header(&requests[0].request, "Accept-Encodin", 14));
+
+  assert(test_known_headers());
+  assert(test_range("Range: bytes=0-499", 0, 499));
+  assert(test_range("Range: bytes=-500", -1, 500));
+  assert(test_range("Range: bytes=99999999999999999999-", -1, -1));
+  assert(test_range("Range: bytes=0-99999999999999999999", -1, -1));
+  assert(test_range("Range: bytes=922337203685477579-", 922337203685477579LL, -1));
+  assert(test_date("If-Modified-Since: Thu, 29 Feb 1996 00:00:00 GMT", 825552000));
+  assert(test_date("If-Modified-Since: Thu, 29 Feb 2000 00:00:00 GMT", 951782400));
+  assert(test_date("If-Modified-Since: Fri, 29 Feb 1900 00:00:00 GMT", -1));
+  assert(test_date("If-Modified-Since: Sat, 31 Feb 1996 00:00:00 GMT", -1));
+  assert(test_date("If-Modified-Since: Thu, 31 Apr 1996 00:00:00 GMT", -1));
+  assert(test_date("If-Modified-Since: Thu, 30 Apr 1996 00:00:00 GMT", 830822400));
+
   // Zed's header tests
 
   assert(test_request(&dumbfuck));
@@ -711,6 +883,8 @@ int main()
   assert(test_request(&two_chunks_mult_zero_end));
   assert(test_request(&chunked_w_trailing_headers));
 
+  assert(test_request(&get_long_cookie));
+  assert(test_request(&get_empty_header));
   assert(test_request(&chunked_w_bullshit_after_length));
   assert(1 == requests[0].request.version_major); 
   assert(1 == requests[0].request.version_minor);
@@ -734,6 +908,13 @@ int main()
   assert(test_scan2(&get_no_headers_no_body, &get_one_header_no_body, &get_no_headers_no_body));
   assert(test_scan2(&get_funky_content_length_body_hello, &post_identity_body_world, &post_chunked_all_your_base));
   assert(test_scan2(&two_chunks_mult_zero_end, &chunked_w_trailing_headers, &chunked_w_bullshit_after_length));
+  assert(test_scan2(&get_long_cookie, &get_one_header_no_body, &get_long_cookie));
+  assert(test_scan2(&get_empty_header, &get_long_cookie, &get_empty_header));
+
+  assert(test_relocate(&get_no_headers_no_body, &get_one_header_no_body, &get_no_headers_no_body));
+  assert(test_relocate(&get_funky_content_length_body_hello, &post_identity_body_world, &post_chunked_all_your_base));
+  assert(test_relocate(&two_chunks_mult_zero_end, &chunked_w_trailing_headers, &chunked_w_bullshit_after_length));
+  assert(test_relocate(&get_long_cookie, &firefox_get, &curl_get));
 
   assert(test_scan3(&get_no_headers_no_body, &get_one_header_no_body, &get_no_headers_no_body));
   assert(test_scan3(&get_funky_content_length_body_hello, &post_identity_body_world, &post_chunked_all_your_base));